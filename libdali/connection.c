@@ -67,6 +67,13 @@ dl_newdlcp (char *address, char *progname)
   dlconn->keepalive_time = 0;
   dlconn->terminate      = 0;
   dlconn->streaming      = 0;
+  dlconn->batchsize      = 0;
+  dlconn->batchwait      = 100;
+  dlconn->pollio         = 0;
+  dlconn->batchbuf       = NULL;
+  dlconn->batchbufsize   = 0;
+  dlconn->batchlen       = 0;
+  dlconn->batchtime      = 0;
 
   dlconn->log = NULL;
 
@@ -86,6 +93,9 @@ dl_freedlcp (DLCP *dlconn)
   if (dlconn->log)
     free (dlconn->log);
 
+  if (dlconn->batchbuf)
+    free (dlconn->batchbuf);
+
   free (dlconn);
 } /* End of dl_freedlcp() */
 
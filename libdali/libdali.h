@@ -238,6 +238,9 @@ typedef struct DLCP_s
   char        clientid[200];    /**< Client program ID as "progname:username:pid:arch", see dlp_genclientid() */
   int         keepalive;        /**< Interval to send keepalive/heartbeat (seconds) */
   int         iotimeout;        /**< Timeout for network I/O operations (seconds) */
+  int32_t     batchsize;        /**< Bytes of packets to batch per send, 0 disables batching */
+  int         batchwait;        /**< Maximum time to hold batched packets (milliseconds) */
+  int8_t      pollio;           /**< Keep socket non-blocking and wait with poll() instead of changing modes for each operation */
 
   /* Connection parameters maintained internally */
   SOCKET      link;		/**< The network socket descriptor, maintained internally */
@@ -250,6 +253,10 @@ typedef struct DLCP_s
   dltime_t    keepalive_time;   /**< Keepalive time stamp, maintained internally */
   int8_t      terminate;        /**< Boolean flag to control connection termination, maintained internally */
   int8_t      streaming;        /**< Boolean flag to indicate streaming status, maintained internally */
+  char       *batchbuf;         /**< Buffer of batched packets, maintained internally */
+  int32_t     batchbufsize;     /**< Size of batch buffer, maintained internally */
+  int32_t     batchlen;         /**< Length of batched packets, maintained internally */
+  dltime_t    batchtime;        /**< Time first packet was batched, maintained internally */
 
   DLLog      *log;              /**< Logging parameters, maintained internally */
 } DLCP;
@@ -300,6 +307,7 @@ extern int     dl_senddata (DLCP *dlconn, void *buffer, size_t sendlen);
 extern int     dl_sendpacket (DLCP *dlconn, void *headerbuf, size_t headerlen,
 			      void *databuf, size_t datalen,
 			      void *respbuf, int resplen);
+extern int     dl_flushbatch (DLCP *dlconn);
 extern int     dl_recvdata (DLCP *dlconn, void *buffer, size_t readlen, uint8_t blockflag);
 extern int     dl_recvheader (DLCP *dlconn, void *buffer, size_t buflen, uint8_t blockflag);
 /** @} */
@@ -27,6 +27,16 @@
 #include "libdali.h"
 #include "portable.h"
 
+#if !defined(DLP_WIN)
+#include <sys/uio.h>
+#endif
+
+static int dl_sendbegin (DLCP *dlconn);
+static int dl_sendend (DLCP *dlconn);
+static int dl_iowait (DLCP *dlconn, int writing);
+static int dl_sendframe (DLCP *dlconn, void *headerbuf, size_t headerlen,
+                         void *databuf, size_t datalen);
+
 /***********************************************************************/ /**
  * @brief Connect to a DataLink server
  *
@@ -211,7 +221,8 @@ dl_connect (DLCP *dlconn)
  * @brief Disconnect a DataLink connection
  *
  * Close the network socket associated with connection and set
- * 'dlconn->link' to -1.
+ * 'dlconn->link' to -1.  Any packets batched by dl_sendpacket() are
+ * sent before closing.
  *
  * @param dlconn DataLink Connection Parameters
  ***************************************************************************/
@@ -220,6 +231,8 @@ dl_disconnect (DLCP *dlconn)
 {
   if (dlconn->link >= 0)
   {
+    dl_flushbatch (dlconn);
+
     dlp_sockclose (dlconn->link);
     dlconn->link = -1;
 
@@ -240,6 +253,10 @@ dl_disconnect (DLCP *dlconn)
  * system socket level this routine will implement the timeout using
  * an alarm timer to interrupt the blocked send.
  *
+ * If DLCP.pollio is set the socket is left in non-blocking mode and
+ * poll() is used to wait, with the I/O timeout, until data can be
+ * sent.
+ *
  * @param dlconn DataLink Connection Parameters
  * @param buffer Buffer containing data to send
  * @param sendlen Number of bytes to send from buffer
@@ -250,6 +267,54 @@ dl_disconnect (DLCP *dlconn)
 int
 dl_senddata (DLCP *dlconn, void *buffer, size_t sendlen)
 {
+  size_t sent = 0;
+  int64_t rv;
+
+  if (dl_sendbegin (dlconn))
+    return -1;
+
+  /* Send data, waiting to send more if the socket is non-blocking */
+  while (sent < sendlen)
+  {
+    rv = send (dlconn->link, (char *)buffer + sent, sendlen - sent, 0);
+
+    if (rv < 0 && dlconn->pollio && !dlp_noblockcheck ())
+    {
+      if (dl_iowait (dlconn, 1) <= 0)
+        return -1;
+
+      continue;
+    }
+
+    if (rv < 0 || (!dlconn->pollio && rv != (int64_t)sendlen))
+    {
+      dl_log_r (dlconn, 2, 0, "[%s] error sending data\n", dlconn->addr);
+      return -1;
+    }
+
+    sent += rv;
+  }
+
+  return dl_sendend (dlconn);
+} /* End of dl_senddata() */
+
+/***********************************************************************/ /**
+ * @brief Prepare socket for sending data
+ *
+ * Set the socket to blocking mode and set the timeout alarm if needed,
+ * unless DLCP.pollio is set.
+ *
+ * @param dlconn DataLink Connection Parameters
+ *
+ * @retval 0 on success
+ * @retval -1 on error.
+ ***************************************************************************/
+static int
+dl_sendbegin (DLCP *dlconn)
+{
+  if (dlconn->pollio)
+    return 0;
+
   /* Set socket to blocking */
   if (dlp_sockblock (dlconn->link))
   {
@@ -268,12 +333,25 @@ dl_senddata (DLCP *dlconn, void *buffer, size_t sendlen)
     }
   }
 
-  /* Send data */
-  if (send (dlconn->link, buffer, sendlen, 0) != (int64_t)sendlen)
-  {
-    dl_log_r (dlconn, 2, 0, "[%s] error sending data\n", dlconn->addr);
-    return -1;
-  }
+  return 0;
+} /* End of dl_sendbegin() */
+
+/***********************************************************************/ /**
+ * @brief Restore socket after sending data
+ *
+ * Cancel the timeout alarm if set and set the socket to non-blocking
+ * mode, unless DLCP.pollio is set.
+ *
+ * @param dlconn DataLink Connection Parameters
+ *
+ * @retval 0 on success
+ * @retval -1 on error.
+ ***************************************************************************/
+static int
+dl_sendend (DLCP *dlconn)
+{
+  if (dlconn->pollio)
+    return 0;
 
   /* Cancel timeout alarm if set */
   if (dlconn->iotimeout > 0)
@@ -294,13 +372,155 @@ dl_senddata (DLCP *dlconn, void *buffer, size_t sendlen)
   }
 
   return 0;
-} /* End of dl_senddata() */
+} /* End of dl_sendend() */
+
+/***********************************************************************/ /**
+ * @brief Wait for a non-blocking socket to be ready for I/O
+ *
+ * Wait using poll() until the socket is ready for reading or, if @a
+ * writing is true, writing, limited by the I/O timeout.
+ *
+ * @param dlconn DataLink Connection Parameters
+ * @param writing Wait for socket to be writable instead of readable
+ *
+ * @retval 1 when ready
+ * @retval 0 on timeout
+ * @retval -1 on error.
+ ***************************************************************************/
+static int
+dl_iowait (DLCP *dlconn, int writing)
+{
+  int timeout = (dlconn->iotimeout < 0) ? -dlconn->iotimeout : dlconn->iotimeout;
+  int rv;
+
+  if ((rv = dlp_sockpoll (dlconn->link, writing, timeout)) < 0)
+    dl_log_r (dlconn, 2, 0, "[%s] error waiting for socket: %s\n",
+              dlconn->addr, dlp_strerror ());
+  else if (rv == 0)
+    dl_log_r (dlconn, 2, 0, "[%s] network I/O timeout after %d seconds\n",
+              dlconn->addr, timeout);
+
+  return rv;
+} /* End of dl_iowait() */
+
+/***********************************************************************/ /**
+ * @brief Send a DataLink packet from its separate parts
+ *
+ * Send the preheader, @a headerbuf and @a databuf as a single DataLink
+ * packet.  On platforms with sendmsg() the parts are sent as separate
+ * I/O vectors without copying, otherwise they are copied into a
+ * single buffer and sent with dl_senddata().
+ *
+ * @param dlconn DataLink Connection Parameters
+ * @param headerbuf Buffer containing DataLink packet header
+ * @param headerlen Length of header buffer to send
+ * @param databuf Buffer containing DataLink packet data
+ * @param datalen Length of data buffer to send
+ *
+ * @retval 0 on success
+ * @retval -1 on error.
+ ***************************************************************************/
+static int
+dl_sendframe (DLCP *dlconn, void *headerbuf, size_t headerlen,
+              void *databuf, size_t datalen)
+{
+#if defined(DLP_WIN)
+  char wirepacket[MAXPACKETSIZE];
+
+  /* Set the synchronization and header size bytes */
+  wirepacket[0] = 'D';
+  wirepacket[1] = 'L';
+  wirepacket[2] = (uint8_t)headerlen;
+
+  /* Copy header and packet data into the wire packet */
+  memcpy (wirepacket + 3, headerbuf, headerlen);
+
+  if (databuf && datalen > 0)
+    memcpy (wirepacket + 3 + headerlen, databuf, datalen);
+
+  return dl_senddata (dlconn, wirepacket, (3 + headerlen + datalen));
+#else
+  char preheader[3];
+  struct iovec iov[3];
+  struct iovec *iovp;
+  struct msghdr msg;
+  size_t sendlen = 3 + headerlen;
+  ssize_t rv;
+
+  /* Set the synchronization and header size bytes */
+  preheader[0] = 'D';
+  preheader[1] = 'L';
+  preheader[2] = (uint8_t)headerlen;
+
+  iov[0].iov_base = preheader;
+  iov[0].iov_len  = 3;
+  iov[1].iov_base = headerbuf;
+  iov[1].iov_len  = headerlen;
+
+  memset (&msg, 0, sizeof (msg));
+  msg.msg_iov    = iov;
+  msg.msg_iovlen = 2;
+
+  if (databuf && datalen > 0)
+  {
+    iov[2].iov_base = databuf;
+    iov[2].iov_len  = datalen;
+    msg.msg_iovlen  = 3;
+    sendlen += datalen;
+  }
+
+  if (dl_sendbegin (dlconn))
+    return -1;
+
+  /* Send packet, waiting to send more if the socket is non-blocking */
+  while (sendlen > 0)
+  {
+    rv = sendmsg (dlconn->link, &msg, 0);
+
+    if (rv < 0 && dlconn->pollio && !dlp_noblockcheck ())
+    {
+      if (dl_iowait (dlconn, 1) <= 0)
+        return -1;
+
+      continue;
+    }
+
+    if (rv < 0 || (!dlconn->pollio && (size_t)rv != sendlen))
+    {
+      dl_log_r (dlconn, 2, 0, "[%s] error sending data\n", dlconn->addr);
+      return -1;
+    }
+
+    /* Skip vectors sent completely and advance into a partial one */
+    sendlen -= rv;
+    iovp = msg.msg_iov;
+
+    while (msg.msg_iovlen > 0 && (size_t)rv >= iovp->iov_len)
+    {
+      rv -= iovp->iov_len;
+      iovp++;
+      msg.msg_iovlen--;
+    }
+
+    if (msg.msg_iovlen > 0)
+    {
+      iovp->iov_base = (char *)iovp->iov_base + rv;
+      iovp->iov_len -= rv;
+    }
+
+    msg.msg_iov = iovp;
+  }
+
+  return dl_sendend (dlconn);
+#endif
+} /* End of dl_sendframe() */
 
 /***********************************************************************/ /**
  * @brief Create and send a DataLink packet
  *
  * Send a DataLink packet created by combining an appropriate
- * preheader with @a headerbuf and, optionally, @a databuf.
+ * preheader with @a headerbuf and, optionally, @a databuf.  The parts
+ * are sent as separate I/O vectors without copying where supported.
  *
  * The header length must be larger than 0 but the packet length can
  * be 0 resulting in a header-only packet, commonly used for sending
@@ -312,6 +532,14 @@ dl_senddata (DLCP *dlconn, void *buffer, size_t sendlen)
  * specifically the server acknowledgement to a command, which are a
  * header-only packets.
  *
+ * If batching is enabled with DLCP.batchsize and no response is
+ * requested the packet is added to a batch buffer instead of being
+ * sent immediately.  Batched packets are sent with a single send when
+ * DLCP.batchsize bytes are collected, when DLCP.batchwait milliseconds
+ * have passed since the first packet was batched (checked when adding
+ * packets), before a packet that requests a response and when
+ * dl_flushbatch() is called.  On error any batched packets are lost.
+ *
  * @param dlconn DataLink Connection Parameters
  * @param headerbuf Buffer containing DataLink packet header
  * @param headerlen Length of header buffer to send
@@ -330,7 +558,8 @@ dl_sendpacket (DLCP *dlconn, void *headerbuf, size_t headerlen,
                void *respbuf, int resplen)
 {
   int bytesread = 0; /* bytes read into resp buffer */
-  char wirepacket[MAXPACKETSIZE];
+  char *wire;
+  int32_t bufsize;
 
   if (!dlconn || !headerbuf)
     return -1;
@@ -351,20 +580,57 @@ dl_sendpacket (DLCP *dlconn, void *headerbuf, size_t headerlen,
     return -1;
   }
 
-  /* Set the synchronization and header size bytes */
-  wirepacket[0] = 'D';
-  wirepacket[1] = 'L';
-  wirepacket[2] = (uint8_t)headerlen;
+  /* Build packet directly in batch buffer if batching and no response */
+  if (dlconn->batchsize > 0 && respbuf == NULL)
+  {
+    /* Buffer holds a full batch plus the largest packet */
+    bufsize = dlconn->batchsize + MAXPACKETSIZE;
 
-  /* Copy header into the wire packet */
-  memcpy (wirepacket + 3, headerbuf, headerlen);
+    if (dlconn->batchbufsize < bufsize)
+    {
+      if ((wire = (char *)realloc (dlconn->batchbuf, bufsize)) == NULL)
+      {
+        dl_log_r (dlconn, 2, 0, "[%s] cannot allocate memory for batch buffer\n",
+                  dlconn->addr);
+        return -1;
+      }
 
-  /* Copy packet data into the wire packet if supplied */
-  if (databuf && datalen > 0)
-    memcpy (wirepacket + 3 + headerlen, databuf, datalen);
+      dlconn->batchbuf     = wire;
+      dlconn->batchbufsize = bufsize;
+    }
+
+    if (dlconn->batchlen == 0)
+      dlconn->batchtime = dlp_time ();
 
-  /* Send data */
-  if (dl_senddata (dlconn, wirepacket, (3 + headerlen + datalen)) < 0)
+    wire = dlconn->batchbuf + dlconn->batchlen;
+
+    /* Set the synchronization and header size bytes */
+    wire[0] = 'D';
+    wire[1] = 'L';
+    wire[2] = (uint8_t)headerlen;
+
+    /* Copy header and packet data, if supplied, into the batch */
+    memcpy (wire + 3, headerbuf, headerlen);
+
+    if (databuf && datalen > 0)
+      memcpy (wire + 3 + headerlen, databuf, datalen);
+
+    dlconn->batchlen += (int32_t)(3 + headerlen + datalen);
+
+    /* Send batch when full or when the first packet has waited too long */
+    if (dlconn->batchlen >= dlconn->batchsize ||
+        (dlp_time () - dlconn->batchtime) >= (dltime_t)dlconn->batchwait * (DLTMODULUS / 1000))
+      return dl_flushbatch (dlconn);
+
+    return 0;
+  }
+
+  /* Send any batched packets first to maintain packet order */
+  if (dlconn->batchlen > 0 && dl_flushbatch (dlconn) < 0)
+    return -1;
+
+  /* Send packet without copying header or data */
+  if (dl_sendframe (dlconn, headerbuf, headerlen, databuf, datalen) < 0)
   {
     /* Check for a message from the server */
     if ((bytesread = dl_recvheader (dlconn, respbuf, resplen, 0)) > 0)
@@ -390,6 +656,47 @@ dl_sendpacket (DLCP *dlconn, void *headerbuf, size_t headerlen,
   return bytesread;
 } /* End of dl_sendpacket() */
 
+/***********************************************************************/ /**
+ * @brief Send batched packets to a DataLink server
+ *
+ * Send all packets batched by dl_sendpacket() with a single send.
+ * This should be called when no further packets will be sent for a
+ * while, e.g. before sleeping, to avoid delaying batched packets.  On
+ * error the batched packets are discarded and the connection should
+ * be considered to be in a bad state.
+ *
+ * @param dlconn DataLink Connection Parameters
+ *
+ * @retval 0 on success
+ * @retval -1 on error.
+ ***************************************************************************/
+int
+dl_flushbatch (DLCP *dlconn)
+{
+  int32_t batchlen;
+
+  if (!dlconn)
+    return -1;
+
+  if (dlconn->batchlen <= 0)
+    return 0;
+
+  batchlen         = dlconn->batchlen;
+  dlconn->batchlen = 0;
+
+  if (dlconn->link < 0)
+  {
+    dl_log_r (dlconn, 2, 0, "[%s] cannot send batched packets, not connected\n",
+              dlconn->addr);
+    return -1;
+  }
+
+  if (dl_senddata (dlconn, dlconn->batchbuf, batchlen) < 0)
+    return -1;
+
+  return 0;
+} /* End of dl_flushbatch() */
+
 /***********************************************************************/ /**
  * @brief Receive arbitrary data from a DataLink server
  *
@@ -407,6 +714,9 @@ dl_sendpacket (DLCP *dlconn, void *headerbuf, size_t headerlen,
  * system socket level this routine will implement the timeout using
  * an alarm timer to interrupt the blocked send.
  *
+ * If DLCP.pollio is set the socket is left in non-blocking mode and
+ * poll() is used to wait, with the I/O timeout, for data to receive.
+ *
  * @param dlconn DataLink Connection Parameters
  * @param buffer Buffer for received data
  * @param readlen Number of bytes to read and place into @a buffer
@@ -430,7 +740,7 @@ dl_recvdata (DLCP *dlconn, void *buffer, size_t readlen, uint8_t blockflag)
   }
 
   /* Set socket to blocking if requested */
-  if (blockflag)
+  if (blockflag && !dlconn->pollio)
   {
     if (dlp_sockblock (dlconn->link))
     {
@@ -441,7 +751,7 @@ dl_recvdata (DLCP *dlconn, void *buffer, size_t readlen, uint8_t blockflag)
   }
 
   /* Set timeout alarm if needed */
-  if (dlconn->iotimeout > 0)
+  if (dlconn->iotimeout > 0 && !dlconn->pollio)
   {
     if (dlp_setioalarm (dlconn->iotimeout))
     {
@@ -455,8 +765,17 @@ dl_recvdata (DLCP *dlconn, void *buffer, size_t readlen, uint8_t blockflag)
   {
     if ((nrecv = recv (dlconn->link, bptr, readlen - nread, 0)) < 0)
     {
+      /* Wait for data if blocking or partially received with a non-blocking socket */
+      if (dlconn->pollio && (blockflag || nread > 0) && !dlp_noblockcheck ())
+      {
+        if (dl_iowait (dlconn, 0) <= 0)
+        {
+          nread = -2;
+          break;
+        }
+      }
       /* The only acceptable error is no data on non-blocking */
-      if (!blockflag && !dlp_noblockcheck ())
+      else if (!blockflag && !dlp_noblockcheck ())
       {
         /* Only break out if no data has yet been received */
         if (nread == 0)
@@ -490,7 +809,7 @@ dl_recvdata (DLCP *dlconn, void *buffer, size_t readlen, uint8_t blockflag)
   }
 
   /* Cancel timeout alarm if set */
-  if (dlconn->iotimeout > 0)
+  if (dlconn->iotimeout > 0 && !dlconn->pollio)
   {
     if (dlp_setioalarm (0))
     {
@@ -500,7 +819,7 @@ dl_recvdata (DLCP *dlconn, void *buffer, size_t readlen, uint8_t blockflag)
   }
 
   /* Set socket to non-blocking if set to blocking */
-  if (blockflag)
+  if (blockflag && !dlconn->pollio)
   {
     if (dlp_socknoblock (dlconn->link))
     {
@@ -523,6 +842,9 @@ dl_recvdata (DLCP *dlconn, void *buffer, size_t readlen, uint8_t blockflag)
  * terminated.  The buffer must be at least 255 bytes in size.  The
  * maximum header length is effectively 254 bytes.
  *
+ * When blocking, any packets batched by dl_sendpacket() are sent
+ * before waiting for the header.
+ *
  * @return number of bytes read on success
  * @retval 0 when no data available on non-blocking socket
  * @retval -1 on connection shutdown
@@ -547,6 +869,10 @@ dl_recvheader (DLCP *dlconn, void *buffer, size_t buflen, uint8_t blockflag)
     return -2;
   }
 
+  /* Send batched packets that may be waiting for a reply */
+  if (blockflag && dlconn->batchlen > 0 && dl_flushbatch (dlconn) < 0)
+    return -2;
+
   /* Receive synchronization bytes and header length */
   if ((bytesread = dl_recvdata (dlconn, buffer, 3, blockflag)) != 3)
   {
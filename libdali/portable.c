@@ -22,6 +22,9 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#if !defined(WIN32) && !defined(_WIN32) && !defined(WIN64) && !defined(_WIN64)
+#include <poll.h>
+#endif
 #include <stdio.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -287,6 +290,52 @@ dlp_setioalarm (int timeout)
   return 0;
 } /* End of dlp_setioalarm() */
 
+/***********************************************************************/ /**
+ * @brief Wait for a network socket to be ready for I/O
+ *
+ * Wait until the socket is ready for reading or, if @a writing is
+ * true, writing.  A @a timeout (specified in seconds) of zero or less
+ * waits indefinitely.
+ *
+ * @param socket Network socket descriptor
+ * @param writing Wait for socket to be writable instead of readable
+ * @param timeout Timeout in seconds
+ *
+ * @return -1 on error, 0 on timeout and 1 when the socket is ready.
+ ***************************************************************************/
+int
+dlp_sockpoll (SOCKET socket, int writing, int timeout)
+{
+#if defined(DLP_WIN)
+  WSAPOLLFD pfd;
+  int rv;
+
+  pfd.fd      = socket;
+  pfd.events  = (writing) ? POLLWRNORM : POLLRDNORM;
+  pfd.revents = 0;
+
+  if ((rv = WSAPoll (&pfd, 1, (timeout > 0) ? timeout * 1000 : -1)) == SOCKET_ERROR)
+    return -1;
+
+#else
+  struct pollfd pfd;
+  int rv;
+
+  pfd.fd      = socket;
+  pfd.events  = (writing) ? POLLOUT : POLLIN;
+  pfd.revents = 0;
+
+  while ((rv = poll (&pfd, 1, (timeout > 0) ? timeout * 1000 : -1)) < 0)
+  {
+    if (errno != EINTR)
+      return -1;
+  }
+
+#endif
+
+  return (rv > 0) ? 1 : 0;
+} /* End of dlp_sockpoll() */
+
 /***********************************************************************/ /**
  * @brief Open a file stream
  *
@@ -37,6 +37,7 @@ extern int dlp_socknoblock (SOCKET socket);
 extern int dlp_noblockcheck (void);
 extern int dlp_setsocktimeo (SOCKET socket, int timeout);
 extern int dlp_setioalarm (int timeout);
+extern int dlp_sockpoll (SOCKET socket, int writing, int timeout);
 
 #ifdef __cplusplus
 }
@@ -12,23 +12,50 @@
  * Written by Chad Trabant, IRIS Data Management Center.
  ***************************************************************************/
 
-/* Possible TODO Re-time records to simulate current data flow */
+/* Needed for splice() and copy_file_range() */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
 #include <regex.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <time.h>
+#include <unistd.h>
+
+/* io_uring is used for prefetching when available */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IOURING 1
+#endif
+#endif
+
+/* Zero-copy output with splice() and copy_file_range() (glibc 2.27) */
+#if defined(__linux__)
+#define HAVE_SPLICE 1
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE 1
+#endif
+#endif
 
 #include <libdali.h>
 #include <libmseed.h>
 
-#define VERSION "0.4"
+#define VERSION "0.5"
 #define PACKAGE "mseedrtstream"
 
 /* Input/output file information containers */
@@ -36,48 +63,604 @@ typedef struct Filelink_s
 {
   char *infilename; /* Input file name */
   FILE *infp;       /* Input file descriptor */
+  char *map;        /* Memory mapping of input file */
+  size_t mapsize;   /* Size of memory mapping */
   struct Filelink_s *next;
 } Filelink;
 
-/* miniSEED record information structures */
+/* miniSEED record index entry.  To keep the index compact the input
+ * file index, file offset and record length exponent are packed into
+ * a single 64-bit location value, see the REC_* macros. */
 typedef struct Record_s
 {
-  struct Filelink_s *flp;
-  off_t offset;
-  int reclen;
-  hptime_t starttime;
-  hptime_t endtime;
-  struct Record_s *prev;
-  struct Record_s *next;
+  hptime_t starttime; /* Record start time */
+  hptime_t endtime;   /* Record end time */
+  uint64_t location;  /* Packed file index, offset and record length */
 } Record;
 
-/* Record map, holds Record structures for a given MSTrace */
+/* Bit layout of packed Record location values:
+ *   bits 0-37  : file offset (up to 256 GiB per file)
+ *   bits 38-41 : record length as power of 2 exponent minus 7
+ *   bits 42-63 : index into input file array (up to ~4 million files) */
+#define REC_OFFSETBITS 38
+#define REC_EXPBITS    4
+#define REC_FILEBITS   22
+
+#define REC_MAXOFFSET ((UINT64_C (1) << REC_OFFSETBITS) - 1)
+#define REC_MAXFILES  (UINT64_C (1) << REC_FILEBITS)
+
+#define REC_FILEIDX(R) ((uint32_t) ((R)->location >> (REC_OFFSETBITS + REC_EXPBITS)))
+#define REC_OFFSET(R)  ((off_t) ((R)->location & REC_MAXOFFSET))
+#define REC_RECLEN(R)  (1 << ((((R)->location >> REC_OFFSETBITS) & ((1 << REC_EXPBITS) - 1)) + 7))
+#define REC_FILE(R)    (fileindex[REC_FILEIDX (R)])
+
+/* Record map, holds a contiguous array of Record entries */
 typedef struct RecordMap_s
 {
-  long long int recordcnt;
-  struct Record_s *first;
-  struct Record_s *last;
+  int64_t recordcnt; /* Count of records in array */
+  int64_t allocated; /* Count of records allocated in array */
+  int64_t limit;     /* Count of records before spilling to disk, 0 is unlimited */
+  Record *records;   /* Array of Record entries */
 } RecordMap;
 
+/* Input scanning statistics */
+typedef struct ScanStats_s
+{
+  int64_t scanned;   /* Count of records scanned */
+  int64_t samplecnt; /* Count of samples in selected records */
+  int64_t indexed;   /* Count of records read from index files */
+} ScanStats;
+
+/* Per-file result of input scanning, used by scanning threads */
+typedef struct ScanResult_s
+{
+  RecordMap recmap; /* Records selected from file */
+  ScanStats stats;  /* Scanning statistics for file */
+  int state;        /* 0 = pending, 1 = complete, -1 = error */
+} ScanResult;
+
+/* Shared state of scanning threads */
+typedef struct ScanControl_s
+{
+  pthread_mutex_t lock;
+  pthread_cond_t done; /* Signaled when a file is complete */
+  uint32_t nextfile;   /* Index of next file to scan */
+  int error;           /* Flag to stop scanning on error */
+  int64_t limit;       /* Record limit of per-file RecordMaps */
+  ScanResult *results; /* Array of results, one per input file */
+} ScanControl;
+
+/* Header values extracted by the header-only record scanner */
+typedef struct RecordHeader_s
+{
+  char srcname[50];   /* Source name: NET_STA_LOC_CHAN_QUAL */
+  hptime_t starttime; /* Record start time */
+  hptime_t endtime;   /* Record end time */
+  int64_t samplecnt;  /* Count of samples in record */
+} RecordHeader;
+
+/* Record index file header, followed by source names and entries */
+typedef struct IndexHeader_s
+{
+  char magic[8];        /* Index format identifier, INDEXMAGIC */
+  uint32_t byteorder;   /* INDEXBYTEORDER in byte order of writer */
+  uint32_t srccount;    /* Count of source names */
+  uint64_t recordcount; /* Count of record entries */
+  uint64_t filesize;    /* Size of indexed file */
+  int64_t filemtime;    /* Modification time of indexed file */
+} IndexHeader;
+
+/* Record index file entry, one for each record in a file */
+typedef struct IndexEntry_s
+{
+  hptime_t starttime; /* Record start time */
+  hptime_t endtime;   /* Record end time */
+  uint64_t offset;    /* Offset of record in file */
+  uint32_t srcid;     /* Index of source name */
+  uint16_t samplecnt; /* Count of samples in record */
+  uint8_t reclenexp;  /* Record length as power of 2 exponent */
+  uint8_t reserved;
+} IndexEntry;
+
+#define INDEXMAGIC     "MSRTIDX1"
+#define INDEXBYTEORDER 0x01020304
+#define INDEXSRCLEN    32         /* Length of source name entries */
+#define INDEXSUFFIX    ".msrtidx" /* Suffix of index files */
+
+/* Index of all records in a file under construction */
+typedef struct IndexBuilder_s
+{
+  IndexEntry *entries;  /* Array of record entries */
+  uint64_t entrycount;  /* Count of record entries */
+  uint64_t entryalloc;  /* Count of record entries allocated */
+  char *srcnames;       /* Array of source names, INDEXSRCLEN each */
+  uint32_t srccount;    /* Count of source names */
+  uint32_t srcalloc;    /* Count of source names allocated */
+  uint32_t *hashtable;  /* Source name hash table, source ID + 1 */
+  uint32_t hashsize;    /* Size of hash table, power of 2 */
+  int unindexable;      /* Set if a record cannot be represented */
+} IndexBuilder;
+
+/* Sequential reader of records in an input file */
+typedef struct RecordCursor_s
+{
+  Filelink *flp;  /* Input file */
+  FILE *fp;       /* Input stream, NULL for memory mapped files */
+  char *buffer;   /* Read buffer or memory map */
+  size_t bufsize; /* Size of read buffer */
+  size_t bufpos;  /* Read position in buffer */
+  size_t buflen;  /* Length of data in buffer */
+  off_t bufstart; /* File offset of buffer start */
+  int eof;        /* Set when end of file has been read */
+} RecordCursor;
+
+/* Input file state for streaming merge */
+typedef struct StreamFile_s
+{
+  RecordCursor cursor; /* Reader of input file */
+  int pending;         /* Count of records of this file in merge heap */
+  int done;            /* Set when all records have been read */
+} StreamFile;
+
+/* Record and identifier of the run it was read from */
+typedef struct MergeNode_s
+{
+  Record rec;      /* Record */
+  uint32_t source; /* Run or input file index */
+} MergeNode;
+
+/* Binary min-heap of Records for merging time ordered runs */
+typedef struct MergeHeap_s
+{
+  MergeNode *nodes; /* Array of heap nodes */
+  size_t count;     /* Count of nodes in heap */
+} MergeHeap;
+
+/* Sorted run of Records spilled to a temporary file */
+typedef struct SpillRun_s
+{
+  FILE *fp;          /* Temporary file, unlinked */
+  int64_t recordcnt; /* Count of records in run */
+  int level;         /* Count of merges leading to this run */
+} SpillRun;
+
+/* All spilled runs, shared by scanning threads */
+typedef struct SpillSet_s
+{
+  pthread_mutex_t lock; /* Lock for adding runs */
+  SpillRun *runs;       /* Array of runs */
+  int runcount;         /* Count of runs */
+  int runalloc;         /* Count of runs allocated */
+  int64_t recordcnt;    /* Count of records in all runs */
+  int64_t spillcnt;     /* Count of records written to runs, including merges */
+} SpillSet;
+
+/* Merge of sorted runs and an optional sorted RecordMap */
+typedef struct RunMerger_s
+{
+  MergeHeap heap;    /* Heap of next record from each run */
+  SpillRun *runs;    /* Array of runs to merge */
+  int runcount;      /* Count of runs to merge */
+  RecordMap *recmap; /* Sorted in-memory records, merged as last run */
+  int64_t recidx;    /* Next record in recmap */
+} RunMerger;
+
+#define SPILLFANIN    16     /* Count of runs of a level merged into one run */
+#define SPILLBUFSIZE  262144 /* Size of I/O buffer for each run */
+
+/* Size of streaming merge per-file read buffer */
+#define STREAMBUFSIZE 65536
+
+/* Chunk of records sorted by a thread */
+typedef struct SortTask_s
+{
+  Record *src;      /* Source record array */
+  Record *dst;      /* Destination record array */
+  int64_t start;    /* Start of chunk in source array */
+  int64_t end;      /* End of chunk in source array, exclusive */
+  int64_t *count;   /* Digit counts or offsets for each pass */
+  int pass;         /* Current pass, -1 to count all passes */
+  int started;      /* Set if the thread was started */
+  pthread_t thread; /* Thread sorting this chunk */
+} SortTask;
+
+/* Record read ahead of output */
+typedef struct PrefetchSlot_s
+{
+  Record rec;     /* Record in slot */
+  char *recptr;   /* Record data, in buffer or memory map */
+  char *buffer;   /* Read buffer */
+  size_t bufsize; /* Size of read buffer */
+  int64_t seq;    /* Output sequence number of record, -1 if none */
+  int state;      /* PREFETCH_* state of slot */
+  struct iovec iov; /* Read vector for asynchronous reads */
+} PrefetchSlot;
+
+/* Ring of records read ahead of output by reader threads */
+typedef struct Prefetch_s
+{
+  pthread_mutex_t lock;
+  pthread_cond_t ready;    /* Signaled when a slot is read */
+  pthread_cond_t released; /* Signaled when a slot is written */
+  PrefetchSlot *slots;     /* Ring of slots */
+  int slotcount;           /* Count of slots in ring */
+  RecordMap *recmap;       /* Sorted records to write */
+  RunMerger *merger;       /* Merger of spilled runs, or NULL */
+  int64_t recidx;          /* Next record in recmap */
+  int64_t nextseq;         /* Sequence number of next record to read */
+  int64_t sendseq;         /* Sequence number of next record to write */
+  int64_t endseq;          /* Count of records when all read, else -1 */
+  int64_t underruns;       /* Count of waits for a record to be read */
+  int error;               /* Flag to stop reading */
+} Prefetch;
+
+#define PREFETCH_READING 1
+#define PREFETCH_READY   2
+#define PREFETCH_ERROR   3
+
+#if HAVE_IOURING
+/* io_uring instance used for asynchronous reads */
+typedef struct IoRing_s
+{
+  int fd;                    /* io_uring file descriptor */
+  unsigned *sqhead;          /* Submission queue head */
+  unsigned *sqtail;          /* Submission queue tail */
+  unsigned sqmask;           /* Submission queue index mask */
+  unsigned *sqarray;         /* Submission queue index array */
+  struct io_uring_sqe *sqes; /* Submission queue entries */
+  unsigned *cqhead;          /* Completion queue head */
+  unsigned *cqtail;          /* Completion queue tail */
+  unsigned cqmask;           /* Completion queue index mask */
+  struct io_uring_cqe *cqes; /* Completion queue entries */
+  void *sqmap;               /* Mapping of submission queue ring */
+  size_t sqmapsize;          /* Size of submission queue ring mapping */
+  void *cqmap;               /* Mapping of completion queue ring */
+  size_t cqmapsize;          /* Size of completion queue ring mapping */
+  size_t sqesize;            /* Size of submission queue entries mapping */
+  unsigned pending;          /* Count of entries queued but not submitted */
+} IoRing;
+#endif
+
+/* Range of an input file containing records of a read batch */
+typedef struct BatchRange_s
+{
+  int first;     /* Index of first record of range in batch order */
+  int last;      /* Index of last record of range in batch order */
+  off_t start;   /* File offset of range */
+  size_t length; /* Length of range */
+} BatchRange;
+
+/* Buffered output file, records are collected in an aligned buffer or
+ * referenced in memory mapped input files and written with writev() */
+typedef struct OutputFile_s
+{
+  char *filename;     /* Output file name, "-" is stdout */
+  int fd;             /* Output file descriptor */
+  flag direct;        /* Output file is written with O_DIRECT */
+  char *buffer;       /* Aligned buffer for copied records */
+  size_t bufsize;     /* Size of buffer, output is flushed at this size */
+  size_t buflen;      /* Bytes used in buffer */
+  size_t pending;     /* Bytes pending output in I/O vectors */
+  struct iovec *iov;  /* I/O vectors of pending output */
+  int iovcnt;         /* Count of I/O vectors used */
+  uint64_t written;   /* Count of bytes written to output file */
+  uint64_t writes;    /* Count of system calls writing output file */
+  hptime_t opentime;  /* Time output file was opened */
+  struct OutputFile_s *next;
+} OutputFile;
+
+#define OUTALIGN  4096 /* Alignment of output buffer and O_DIRECT writes */
+#define OUTIOVMAX 1024 /* Maximum I/O vectors per write */
+
+/* Record sent to the DataLink server and not yet acknowledged */
+typedef struct AckSlot_s
+{
+  Record rec;   /* Record entry */
+  char *buffer; /* Copy of record for retransmission */
+  int bufsize;  /* Size of buffer */
+} AckSlot;
+
+/* Window of DataLink writes in flight, acknowledged in order sent */
+typedef struct AckWindow_s
+{
+  AckSlot *slots;    /* Ring of records in flight */
+  int head;          /* Index of oldest record in flight */
+  int count;         /* Count of records in flight */
+  uint64_t acked;    /* Count of records acknowledged */
+  uint64_t rejected; /* Count of records rejected by the server */
+  uint64_t resent;   /* Count of records retransmitted */
+} AckWindow;
+
+/* DataLink connection, records are sharded over multiple connections
+ * by source name.  With multiple connections or destinations each
+ * connection sends records from its own queue in a separate thread */
+typedef struct DLSender_s
+{
+  DLCP *dlconn;          /* DataLink connection parameters */
+  AckWindow ackwin;      /* Records awaiting acknowledgement */
+  pthread_t thread;      /* Sender thread */
+  flag started;          /* Sender thread is running */
+  pthread_mutex_t lock;  /* Lock for queue */
+  pthread_cond_t queued; /* Signaled when a record is queued */
+  pthread_cond_t sent;   /* Signaled when a record is sent */
+  AckSlot *queue;        /* Ring of records to send */
+  int qhead;             /* Index of next record to send */
+  int qcount;            /* Count of queued records */
+  flag done;             /* No more records will be queued */
+  flag closed;           /* Connection closed after queue was full */
+  uint64_t records;      /* Count of records sent */
+  uint64_t dropped;      /* Count of records dropped */
+  uint64_t bytes;        /* Count of bytes sent */
+  hptime_t starttime;    /* Time connection was opened */
+  hptime_t endtime;      /* Time last record was sent */
+} DLSender;
+
+/* Histogram of pacing lateness in nanoseconds, values below LATESUB
+ * have exact buckets and larger values LATESUB buckets per power of 2 */
+#define LATESUB     16
+#define LATEBUCKETS (60 * LATESUB)
+
+typedef struct PaceStats_s
+{
+  uint64_t hist[LATEBUCKETS]; /* Count of records in each lateness bucket */
+  uint64_t count;             /* Count of paced records */
+  int64_t max;                /* Maximum lateness */
+} PaceStats;
+
+/* Token bucket limiting output to a target rate */
+typedef struct RateBucket_s
+{
+  int64_t basetime;   /* Monotonic time of the first record, -1 before */
+  int64_t filltime;   /* Monotonic time tokens were last added */
+  double tokens;      /* Available tokens, records or bytes */
+  int64_t reporttime; /* Start of the reporting interval */
+  uint64_t records;   /* Count of records in the interval */
+  uint64_t bytes;     /* Count of bytes in the interval */
+  uint64_t reports;   /* Count of reported intervals */
+  double devsum;      /* Sum of absolute deviations of reported intervals */
+  double devmax;      /* Maximum absolute deviation */
+} RateBucket;
+
+#define RATEBURST   0.01     /* Seconds of output at the target rate allowed as a burst */
+#define RATEMAXWAIT 10000000 /* Nanoseconds to wait before re-evaluating the rate */
+
+/* Ramp up profiles of the target rate */
+#define RAMP_NONE   0
+#define RAMP_LINEAR 1 /* Linear increase from 0 */
+#define RAMP_STEP   2 /* Equal steps */
+
+/* Delivery latency model for streams matching a pattern */
+typedef struct LatencyModel_s
+{
+  regex_t pattern;      /* Source names the model applies to */
+  hptime_t delay;       /* Constant delay */
+  int jitter;           /* Jitter distribution, JITTER_* */
+  hptime_t jitterscale; /* Width, standard deviation or mean of jitter */
+  hptime_t period;      /* Outage period, 0 for no outages */
+  hptime_t outage;      /* Outage duration */
+  hptime_t phase;       /* Start of outages within each period */
+  struct LatencyModel_s *next;
+} LatencyModel;
+
+/* Latency jitter distributions */
+#define JITTER_NONE    0
+#define JITTER_UNIFORM 1 /* Uniform from 0 to scale */
+#define JITTER_NORMAL  2 /* Normal with a standard deviation of scale */
+#define JITTER_EXP     3 /* Exponential with a mean of scale */
+
+/* Delivery state of a stream in a table hashed by source name */
+typedef struct DelayStream_s
+{
+  char srcname[50];     /* Source name, empty for an unused entry */
+  LatencyModel *model;  /* Latency model of the stream, NULL if none */
+  hptime_t lastrelease; /* Release time of the previous record */
+} DelayStream;
+
+/* Record held until its release time */
+typedef struct DelayNode_s
+{
+  hptime_t release; /* Release time in data time */
+  uint64_t seq;     /* Arrival sequence, orders equal release times */
+  Record rec;       /* Record description */
+  char *record;     /* Copy of the record */
+} DelayNode;
+
+/* Records held by latency models in a heap ordered by release time */
+typedef struct DelayQueue_s
+{
+  DelayNode *nodes;     /* Heap of held records */
+  int count;            /* Count of held records */
+  int size;             /* Allocated size of heap */
+  int maxcount;         /* Maximum count of held records */
+  uint64_t seq;         /* Next arrival sequence */
+  DelayStream *streams; /* Stream table, open addressing */
+  int streamsize;       /* Size of stream table, a power of 2 */
+  int streamcount;      /* Count of streams in table */
+  uint64_t delayed;     /* Count of delayed records */
+  double delaysum;      /* Sum of delays in seconds */
+  hptime_t delaymax;    /* Maximum delay */
+} DelayQueue;
+
+/* Policies for a full DataLink send queue */
+#define QUEUE_BLOCK      0 /* Wait for space in the queue */
+#define QUEUE_DROP       1 /* Drop the record */
+#define QUEUE_DISCONNECT 2 /* Close the connection and drop its records */
+
+/* Zero-copy output methods */
+#define OUTCOPY_NONE   0 /* Buffered copy through memory */
+#define OUTCOPY_RANGE  1 /* copy_file_range() to a regular file */
+#define OUTCOPY_SPLICE 2 /* splice() to a pipe */
+#define COPYMAXLEN     4194304 /* Maximum length of a coalesced copy */
+
+#define BATCHGAP     65536   /* Maximum gap between coalesced records */
+#define BATCHMAXREAD 4194304 /* Maximum size of coalesced reads */
+
+/* Size of header-only scanner read buffer, must be larger than MAXRECLEN */
+#define SCANBUFSIZE (4 * MAXRECLEN)
+
+/* Initial and maximum increment of RecordMap growth, in records */
+#define RECMAP_INITIAL   65536
+#define RECMAP_MAXGROWTH 16777216
+#define RECMAP_MINLIMIT  1024
+
+/* Radix sort digit size and passes to cover 64-bit keys */
+#define RADIXBITS   11
+#define RADIXSIZE   (1 << RADIXBITS)
+#define RADIXPASSES ((64 + RADIXBITS - 1) / RADIXBITS)
+
+/* Radix sort key of a Record, end time with sign bit flipped to sort unsigned */
+#define RADIXKEY(R) ((uint64_t) (R)->endtime ^ (UINT64_C (1) << 63))
+
+/* Minimum count of records sorted by each thread */
+#define SORTTASKMIN 65536
+
 static int readfiles (RecordMap *recmap);
+static int scanfile (uint32_t fileidx, RecordMap *recmap, ScanStats *stats);
+static int loadindex (uint32_t fileidx, struct stat *sbuf, RecordMap *recmap, ScanStats *stats);
+static int indexadd (IndexBuilder *builder, off_t offset, int recordlen, const char *srcname,
+                     hptime_t recstarttime, hptime_t recendtime, int64_t samplecnt);
+static int writeindex (IndexBuilder *builder, uint32_t fileidx, struct stat *sbuf);
+static void resetindex (IndexBuilder *builder);
+static void freeindex (IndexBuilder *builder);
+static char *indexpath (const char *filename, char *path, size_t pathsize);
+static int scanheaders (uint32_t fileidx, RecordMap *recmap, ScanStats *stats,
+                        IndexBuilder *builder);
+static int cursoropen (RecordCursor *cursor, Filelink *flp, size_t bufsize);
+static int cursorfill (RecordCursor *cursor, size_t minsize);
+static int cursornext (RecordCursor *cursor, RecordHeader *hdr, off_t *offset,
+                       int *recordlen, char **record);
+static void cursorclose (RecordCursor *cursor);
+static int scanrecords (uint32_t fileidx, RecordMap *recmap, ScanStats *stats,
+                        IndexBuilder *builder);
+static int selectrecord (RecordMap *recmap, uint32_t fileidx, off_t offset, int recordlen,
+                         const char *srcname, hptime_t recstarttime, hptime_t recendtime);
+static const char *timeskip (hptime_t recstarttime, hptime_t recendtime);
+static const char *sourceskip (const char *srcname);
+static int addselected (RecordMap *recmap, uint32_t fileidx, off_t offset, int recordlen,
+                        hptime_t recstarttime, hptime_t recendtime);
+static int parseheader (const char *record, int recordlen, RecordHeader *hdr);
+static int retimerecord (char *record, int recordlen, hptime_t shift);
+static int scanthreaded (RecordMap *recmap, ScanStats *stats);
+static void *scanworker (void *arg);
 static int writerecords (RecordMap *recmap);
-static int sendrecord (char *recbuf, Record *rec);
-
+static int spillrecmap (RecordMap *recmap);
+static FILE *spillfile (void);
+static int spillmerge (int level);
+static int mergeropen (RunMerger *merger, SpillRun *runs, int runcount, RecordMap *recmap);
+static int mergernext (RunMerger *merger, Record *rec);
+static int mergerread (RunMerger *merger, uint32_t source);
+static void mergerclose (RunMerger *merger);
+static int nextrecord (RecordMap *recmap, RunMerger *merger, int64_t *recidx, Record *rec);
+static int prefetchrecords (RecordMap *recmap, RunMerger *merger, OutputFile *ofp);
+static void *prefetchworker (void *arg);
+static int prefetchread (PrefetchSlot *slot, Filelink *flp, int reclength);
+static int prefetchslot (PrefetchSlot *slot, Filelink *flp, int reclength);
+#if HAVE_IOURING
+static int prefetchuring (RecordMap *recmap, RunMerger *merger, OutputFile *ofp);
+static int ringopen (IoRing *ring, unsigned entries);
+static void ringread (IoRing *ring, int fd, struct iovec *iov, off_t offset, uint64_t userdata);
+static int ringenter (IoRing *ring, unsigned waitcount);
+static void ringclose (IoRing *ring);
+#endif
+static int streamrecords (void);
+static int streamfill (StreamFile *sfp, uint32_t fileidx, MergeHeap *heap, int64_t *samplecnt);
+static char *streamrecptr (StreamFile *sfp, Record *rec);
+static void heappush (MergeHeap *heap, Record *rec, uint32_t source);
+static int heappop (MergeHeap *heap, Record *rec, uint32_t *source);
+static int mergecmp (Record *rec1, Record *rec2);
+static int openoutput (OutputFile **ofp);
+static int closeoutput (OutputFile *ofp);
+static int outputwrite (OutputFile *ofp, char *ptr, size_t length, flag mapped);
+static int outputflush (OutputFile *ofp, flag final);
+static int writerecord (Record *rec, char *recptr, OutputFile *ofp);
+static int outputrecord (Record *rec, char *recptr, OutputFile *ofp, hptime_t release);
+static int delayrecord (Record *rec, char *recptr, OutputFile *ofp);
+static int delayflush (OutputFile *ofp);
+static DelayStream *delaystream (char *recptr);
+static hptime_t delayrelease (DelayStream *ss, Record *rec);
+static int delaypush (DelayNode *node);
+static void delaypop (DelayNode *node);
+static double randomjitter (int jitter);
+static double randomuniform (void);
+static void pacerecord (hptime_t datatime);
+static void raterecord (int reclength);
+static double targetrate (int64_t elapsed);
+static double targettokens (int64_t elapsed);
+static void ratereport (int64_t now);
+static void pacesleep (int64_t deadline);
+static int latebucket (int64_t lateness);
+static int64_t latepercentile (double fraction);
+static void countread (Filelink *flp, off_t offset, size_t length);
+static int copyrange (Filelink *flp, off_t offset, size_t length, OutputFile *ofp);
+static int copyflush (OutputFile *ofp);
+static int batchrecords (RecordMap *recmap, RunMerger *merger, OutputFile *ofp);
+static int batchcmp (const void *a, const void *b);
+static int startsenders (void);
+static void stopsenders (void);
+static int selectshard (char *recbuf);
+static int queuerecord (DLSender *sp, char *recbuf, Record *rec);
+static void *senderworker (void *arg);
+static int senderclosed (DLSender *sp);
+static int slotcopy (AckSlot *slot, char *recbuf, Record *rec);
+static int sendrecord (DLSender *sp, char *recbuf, Record *rec);
+static int sendpacket (DLSender *sp, char *recbuf, Record *rec, flag ack);
+static int ackreceive (DLSender *sp, flag block);
+static int ackresend (DLSender *sp);
+static void ackwait (DLSender *sp);
+static void reconnect (DLSender *sp);
+
+static Record *addrecord (RecordMap *recmap);
+static int packrecord (Record *rec, uint32_t fileidx, off_t offset, int reclen);
 static int sortrecmap (RecordMap *recmap);
-static int recordcmp (Record *rec1, Record *rec2);
+static void sortphase (SortTask *tasks, int ntasks, void *(*routine) (void *));
+static void *sortcount (void *arg);
+static void *sortscatter (void *arg);
 
 static int processparam (int argcount, char **argvec);
 static char *getoptval (int argcount, char **argvec, int argopt);
+static double parsesize (const char *str);
+static double parserate (const char *str, flag *bytes);
 static hptime_t gethptime (void);
+static int64_t getmonotime (void);
 static int setofilelimit (int limit);
+static int mapfile (Filelink *flp);
+static void adviseinput (int advice);
+static void unmapfiles (void);
 static int addfile (char *filename);
 static int addlistfile (char *filename);
 static int readregexfile (char *regexfile, char **pppattern);
+static int readlatencyfile (char *latencyfile);
+static int parseseconds (const char *str, hptime_t *value);
 static void usage (void);
 
-static flag verbose  = 0;
-static flag basicsum = 0;  /* Controls printing of basic summary */
-static int reclen    = -1; /* Input data record length, autodetected in most cases */
+static flag verbose     = 0;
+static flag basicsum    = 0;  /* Controls printing of basic summary */
+static int reclen       = -1; /* Input data record length, autodetected in most cases */
+static int threadcount  = 1;  /* Number of threads for input scanning and sorting */
+static flag fullscan    = 0;  /* Fully parse records with libmseed when scanning */
+static flag usemmap     = 0;  /* Memory map input files for scanning and output */
+static flag useindex    = 0;  /* Use and maintain record index files */
+static char *indexdir   = 0;  /* Directory for index files, default is next to input */
+static flag streammode  = 0;  /* Merge time ordered input files instead of sorting */
+static int64_t maxmem   = 0;  /* Memory limit for record index, 0 is unlimited */
+static char *tmpdir     = 0;  /* Directory for spilled record runs */
+static int prefetchslots = 0; /* Records read ahead of output, 0 disables */
+static int batchsize     = 0; /* Records per coalesced read batch, 0 disables */
+static flag useiouring   = 0; /* Use io_uring for prefetching if available */
+static size_t outbufsize = 1048576; /* Output buffer size and flush threshold */
+static flag outdirect    = 0; /* Write output file with O_DIRECT */
+static int ackwindow     = 0; /* DataLink writes in flight awaiting acknowledgement */
+static int dlbatchsize   = 0; /* Bytes of DataLink packets batched per send, 0 disables */
+static int dlbatchwait   = 100; /* Milliseconds to hold batched DataLink packets */
+static int dlconns       = 1; /* DataLink connections records are sharded over */
+static int queuelen      = 256; /* Records queued for each DataLink connection */
+static int queuepolicy   = QUEUE_BLOCK; /* Policy for a full queue, QUEUE_* */
+static int outputcopy    = 0; /* Zero-copy output method, OUTCOPY_* */
+static Filelink *copyflp = 0; /* Input file of pending zero-copy range */
+static off_t copyoffset  = 0; /* Input offset of pending zero-copy range */
+static size_t copylength = 0; /* Length of pending zero-copy range */
+static SpillSet spillset;     /* Runs of records spilled to disk */
+static int streamwindow = 64; /* Records of each file held for merging */
 
 static hptime_t starttime = HPTERROR; /* Limit to records containing or after starttime */
 static hptime_t endtime   = HPTERROR; /* Limit to records containing or before endtime */
@@ -87,20 +670,50 @@ static regex_t *reject = 0; /* Compiled reject regex */
 
 static flag streamdelay   = 0;   /* Delay output to simulate real time stream */
 static double delayfactor = 1.0; /* Delay factor, 1.0 is actual time stepping */
-
-static char *outputfile = 0; /* Single output file */
+static int64_t spinwait   = 0;   /* Nanoseconds to busy-wait before pacing deadlines */
+static flag retime        = 0;   /* Shift record times so output appears current */
+static hptime_t timeshift = HPTERROR; /* Shift applied to record times */
+static flag loop          = 0;   /* Repeat output with advancing record times */
+static hptime_t loopstart = HPTERROR; /* Earliest record start time */
+static hptime_t loopend   = HPTERROR; /* Latest record end time */
+static PaceStats pacestats;      /* Lateness of paced records */
+static double ratelimit   = 0.0; /* Target output rate, records or bytes per second */
+static flag ratebytes     = 0;   /* Target rate is in bytes per second */
+static int rampprofile    = RAMP_NONE; /* Ramp up profile of the target rate, RAMP_* */
+static double ramptime    = 0.0; /* Seconds to ramp up to the target rate */
+static int rampsteps      = 0;   /* Steps of a step ramp up */
+static RateBucket ratebucket = {.basetime = -1}; /* Token bucket for the target rate */
+static LatencyModel *latencymodels = 0; /* Delivery latency models, first match applies */
+static DelayQueue delayqueue;    /* Records held by latency models */
+static uint64_t jitterstate = UINT64_C (0x9E3779B97F4A7C15); /* Jitter generator state */
+
+static char **outputfiles = 0; /* Output files */
+static int outputcount    = 0; /* Count of output files */
+static char **dladdresses = 0; /* DataLink server destinations */
+static int dlcount        = 0; /* Count of DataLink server destinations */
 
 static char recordbuf[16384]; /* Global record buffer */
 
+static uint64_t totalrecsout  = 0; /* Count of records written */
+static uint64_t totalbytesout = 0; /* Count of bytes written */
+static uint64_t totalreads     = 0; /* Count of input reads for output */
+static uint64_t totalseeks     = 0; /* Count of non-sequential input reads */
+static uint64_t totalbytesread = 0; /* Count of input bytes read for output */
+static uint64_t totalcopied    = 0; /* Count of bytes copied without reading */
+
 static Filelink *filelist     = 0; /* List of input files */
 static Filelink *filelisttail = 0; /* Tail of list of input files */
+static Filelink **fileindex   = 0; /* Array of input files, indexed by Record */
+static uint32_t filecount     = 0; /* Count of input files */
 
-static DLCP *dlconn = 0;
+static DLSender *senders = 0; /* DataLink connections, dlconns per destination */
+static int sendercount   = 0; /* Count of DataLink connections */
 
 int
 main (int argc, char **argv)
 {
   RecordMap recmap;
+  hptime_t sortstart;
 
   /* Process input parameters */
   if (processparam (argc, argv) < 0)
@@ -113,18 +726,36 @@ main (int argc, char **argv)
   dl_loginit (verbose, NULL, NULL, NULL, "ERROR: ");
 
   /* Connect to DataLink server */
-  if (dlconn)
+  if (senders && startsenders ())
+    return -1;
+
+  /* Merge time ordered input files directly to output */
+  if (streammode)
   {
-    if (dl_connect (dlconn) < 0)
-    {
-      ms_log (2, "Error connecting to DataLink server\n");
-      return -1;
-    }
+    if (verbose > 1)
+      ms_log (1, "Streaming input files\n");
+
+    if (streamrecords ())
+      return 1;
+
+    return 0;
   }
 
   recmap.recordcnt = 0;
-  recmap.first     = NULL;
-  recmap.last      = NULL;
+  recmap.allocated = 0;
+  recmap.limit     = 0;
+  recmap.records   = NULL;
+
+  /* Limit in-memory records, the sort needs a buffer of equal size */
+  if (maxmem > 0)
+  {
+    recmap.limit = maxmem / (2 * sizeof (Record));
+
+    if (recmap.limit < RECMAP_MINLIMIT)
+      recmap.limit = RECMAP_MINLIMIT;
+
+    pthread_mutex_init (&spillset.lock, NULL);
+  }
 
   if (verbose > 1)
     ms_log (1, "Reading input files\n");
@@ -136,6 +767,8 @@ main (int argc, char **argv)
   if (verbose > 1)
     ms_log (1, "Sorting record list\n");
 
+  sortstart = gethptime ();
+
   /* Sort the record map into time order */
   if (sortrecmap (&recmap))
   {
@@ -143,14 +776,14 @@ main (int argc, char **argv)
     return 1;
   }
 
+  if (verbose)
+    ms_log (1, "Sorted %lld records in %.3f seconds\n", (long long int)recmap.recordcnt,
+            (double)(gethptime () - sortstart) / HPTMODULUS);
+
   /* Write records */
   if (writerecords (&recmap))
     return 1;
 
-  /* Shut down the connection to DataLink server */
-  if (dlconn && dlconn->link != -1)
-    dl_disconnect (dlconn);
-
   return 0;
 } /* End of main() */
 
@@ -160,504 +793,5675 @@ main (int argc, char **argv)
  * Read input files specified as a Filelink list and populate an
  * RecordMap (list of records).
  *
+ * When multiple threads are configured the input files are scanned
+ * concurrently, each file into its own RecordMap, and the per-file
+ * results are appended to the final RecordMap in input file order
+ * as they complete.  The resulting RecordMap is identical to that
+ * produced by a single threaded scan.
+ *
  * Returns 0 on success and -1 otherwise.
  ***************************************************************************/
 static int
 readfiles (RecordMap *recmap)
 {
-  MSFileParam *msfp = NULL;
-  Filelink *flp;
-  MSRecord *msr = 0;
-
-  int totalrecs  = 0;
-  int totalsamps = 0;
-  int totalfiles = 0;
-
   Record *rec = 0;
+  ScanStats stats;
+  ScanStats filestats;
+  uint32_t fileidx;
+  hptime_t scanstart;
+  double scantime;
 
-  off_t fpos = 0;
-  hptime_t recstarttime;
-  hptime_t recendtime;
+  int64_t totalrecs  = 0;
+  int64_t totalsamps = 0;
+  int totalfiles     = 0;
 
-  char srcname[50];
-  char stime[30];
+  if (!recmap)
+    return -1;
 
-  int retcode;
+  memset (&stats, 0, sizeof (stats));
+  scanstart = gethptime ();
 
   /* Read all input files and populate record list */
+  if (threadcount > 1 && filecount > 1)
+  {
+    if (scanthreaded (recmap, &stats))
+      return -1;
 
-  flp = filelist;
-
-  while (flp != 0)
+    totalfiles = filecount;
+  }
+  else
   {
-    /* Loop over the input file */
-    while ((retcode = ms_readmsr_main (&msfp, &msr, flp->infilename, reclen, &fpos, NULL, 1, 0, NULL, verbose - 2)) == MS_NOERROR)
+    for (fileidx = 0; fileidx < filecount; fileidx++)
     {
-      recstarttime = msr->starttime;
-      recendtime   = msr_endtime (msr);
-
-      /* Generate the srcname with the quality code */
-      msr_srcname (msr, srcname, 1);
-
-      /* Check if record matches start time criteria: starts after or contains starttime */
-      if ((starttime != HPTERROR) && (recstarttime < starttime && !(recstarttime <= starttime && recendtime >= starttime)))
-      {
-        if (verbose >= 3)
-        {
-          ms_hptime2seedtimestr (recstarttime, stime, 1);
-          ms_log (1, "Skipping (starttime) %s, %s\n", srcname, stime);
-        }
-        continue;
-      }
-
-      /* Check if record matches end time criteria: ends after or contains endtime */
-      if ((endtime != HPTERROR) && (recendtime > endtime && !(recstarttime <= endtime && recendtime >= endtime)))
-      {
-        if (verbose >= 3)
-        {
-          ms_hptime2seedtimestr (recstarttime, stime, 1);
-          ms_log (1, "Skipping (endtime) %s, %s\n", srcname, stime);
-        }
-        continue;
-      }
-
-      /* Check if record is matched by the match regex */
-      if (match)
-      {
-        if (regexec (match, srcname, 0, 0, 0) != 0)
-        {
-          if (verbose >= 3)
-          {
-            ms_hptime2seedtimestr (recstarttime, stime, 1);
-            ms_log (1, "Skipping (match) %s, %s\n", srcname, stime);
-          }
-          continue;
-        }
-      }
-
-      /* Check if record is rejected by the reject regex */
-      if (reject)
-      {
-        if (regexec (reject, srcname, 0, 0, 0) == 0)
-        {
-          if (verbose >= 3)
-          {
-            ms_hptime2seedtimestr (recstarttime, stime, 1);
-            ms_log (1, "Skipping (reject) %s, %s\n", srcname, stime);
-          }
-          continue;
-        }
-      }
-
-      if (verbose > 2)
-        msr_print (msr, verbose - 3);
-
-      /* Create and populate new Record structure */
-      if (!(rec = (Record *)malloc (sizeof (Record))))
-      {
-        ms_log (2, "Cannot allocate memory for Record entry\n");
+      if (scanfile (fileidx, recmap, &filestats))
         return -1;
-      }
-
-      rec->flp       = flp;
-      rec->offset    = fpos;
-      rec->reclen    = msr->reclen;
-      rec->starttime = recstarttime;
-      rec->endtime   = recendtime;
-      rec->prev      = 0;
-      rec->next      = 0;
-
-      /* Add the new Record to end of the RecordMap */
-      if (!recmap->first)
-        recmap->first = rec;
-
-      if (recmap->last)
-        recmap->last->next = rec;
 
-      rec->prev    = recmap->last;
-      recmap->last = rec;
+      stats.scanned += filestats.scanned;
+      stats.samplecnt += filestats.samplecnt;
+      stats.indexed += filestats.indexed;
+      totalfiles++;
+    }
+  }
 
-      recmap->recordcnt++;
+  scantime   = (double)(gethptime () - scanstart) / HPTMODULUS;
+  totalrecs  = recmap->recordcnt + spillset.recordcnt;
+  totalsamps = stats.samplecnt;
 
-      totalrecs++;
-      totalsamps += msr->samplecnt;
-    } /* End of looping through records in file */
+  /* Records will be read from mappings in time order, i.e. randomly */
+  if (usemmap)
+    adviseinput (MADV_RANDOM);
 
-    /* Critical error if file was not read properly */
-    if (retcode != MS_ENDOFFILE)
+  /* Trim unused entries from the end of the record array */
+  if (recmap->allocated > recmap->recordcnt && recmap->recordcnt > 0)
+  {
+    if ((rec = (Record *)realloc (recmap->records, recmap->recordcnt * sizeof (Record))))
     {
-      ms_log (2, "Cannot read %s: %s\n", flp->infilename, ms_errorstr (retcode));
-      ms_readmsr_main (&msfp, &msr, NULL, 0, NULL, NULL, 0, 0, NULL, 0);
-      return -1;
+      recmap->records   = rec;
+      recmap->allocated = recmap->recordcnt;
     }
-
-    /* Make sure everything is cleaned up */
-    ms_readmsr_main (&msfp, &msr, NULL, 0, NULL, NULL, 0, 0, NULL, 0);
-
-    totalfiles++;
-    flp = flp->next;
-  } /* End of looping over file list */
+  }
 
   /* Increase open file limit if necessary, in general we need the
    * filecount and some wiggle room. */
   setofilelimit (totalfiles + 20);
 
+  if (verbose)
+  {
+    ms_log (1, "Scanned %lld records in %.3f seconds (%.0f records/s, %s scan)\n",
+            (long long int)stats.scanned, scantime,
+            (scantime > 0.0) ? stats.scanned / scantime : 0.0,
+            (fullscan) ? "full" : "header");
+
+    if (useindex)
+      ms_log (1, "Read %lld of %lld records from index files\n",
+              (long long int)stats.indexed, (long long int)stats.scanned);
+  }
+
   if (basicsum)
-    ms_log (0, "Files: %d, Records: %d, Samples: %d\n", totalfiles, totalrecs, totalsamps);
+  {
+    ms_log (0, "Files: %d, Records: %lld, Samples: %lld\n", totalfiles,
+            (long long int)totalrecs, (long long int)totalsamps);
+    ms_log (0, "Record index: %llu bytes, %.1f bytes/record\n",
+            (long long unsigned int)(recmap->allocated * sizeof (Record)),
+            (totalrecs) ? (double)(recmap->allocated * sizeof (Record)) / totalrecs : 0.0);
+
+    if (spillset.runcount > 0)
+      ms_log (0, "Spilled records: %lld in %d runs, %llu bytes written\n",
+              (long long int)spillset.recordcnt, spillset.runcount,
+              (long long unsigned int)(spillset.spillcnt * sizeof (Record)));
+  }
 
   return 0;
 } /* End of readfiles() */
 
 /***************************************************************************
- * writerecords():
+ * scanfile:
  *
- * Write all records in the RecordMap to output.
+ * Read a single input file, identified by it's index in the file
+ * array, and add an entry to the RecordMap for each record that
+ * matches the selection criteria.  The count of records scanned and
+ * samples in the added records are returned in stats.
  *
- * Returns 0 on success and 1 on error.
+ * By default the header-only scanner is used, files that it does not
+ * support, such as packed files, and all files when fullscan is set
+ * are read with the libmseed record reader.
+ *
+ * If memory mapping is enabled the file is mapped and the mapping is
+ * retained for use when writing records.
+ *
+ * If index files are enabled and a current index exists for the file
+ * the records are selected from the index and the file is not read.
+ * Otherwise an index of all records is built while scanning and
+ * written for later use.
+ *
+ * This routine may be called concurrently for different files and
+ * RecordMaps.
+ *
+ * Returns 0 on success and -1 otherwise.
  ***************************************************************************/
 static int
-writerecords (RecordMap *recmap)
+scanfile (uint32_t fileidx, RecordMap *recmap, ScanStats *stats)
 {
-  static uint64_t totalrecsout  = 0;
-  static uint64_t totalbytesout = 0;
-  hptime_t now;
-  hptime_t offset = HPTERROR;
-  Filelink *flp;
-  Record *rec;
-  char errflag = 0;
+  IndexBuilder *builder = NULL;
+  struct stat sbuf;
+  int64_t recordcnt;
+  int rv;
 
-  FILE *ofp = 0;
+  if (fileidx >= filecount || !recmap || !stats)
+    return -1;
 
-  if (!recmap)
-    return 1;
+  memset (stats, 0, sizeof (ScanStats));
 
-  /* Open the output file if specified */
-  if (outputfile)
-  {
-    if (verbose)
-      ms_log (1, "Writing output data to %s\n", outputfile);
+  if (usemmap && mapfile (fileindex[fileidx]))
+    return -1;
 
-    if (strcmp (outputfile, "-") == 0)
+  if (useindex)
+  {
+    if (stat (fileindex[fileidx]->infilename, &sbuf))
     {
-      ofp = stdout;
+      ms_log (2, "Cannot stat file: %s (%s)\n", fileindex[fileidx]->infilename, strerror (errno));
+      return -1;
     }
-    else if ((ofp = fopen (outputfile, "wb")) == NULL)
+
+    /* Select records from an existing index if current */
+    if ((rv = loadindex (fileidx, &sbuf, recmap, stats)) <= 0)
+      return rv;
+
+    if (!(builder = (IndexBuilder *)calloc (1, sizeof (IndexBuilder))))
     {
-      ms_log (2, "Cannot open output file: %s (%s)\n",
-              outputfile, strerror (errno));
-      return 1;
+      ms_log (2, "Cannot allocate memory for index\n");
+      return -1;
     }
   }
 
-  if (dlconn)
-  {
-    if (verbose)
-      ms_log (1, "Sending output data to %s\n", dlconn->addr);
-  }
+  rv = 1;
 
-  /* Loop through record list and send/write records */
-  rec = recmap->first;
-  while (rec && errflag != 1)
+  if (!fullscan)
   {
-    /* Reset error flag for continuation errors */
-    if (errflag == 2)
-      errflag = 0;
+    recordcnt = recmap->recordcnt;
 
-    /* Make sure the record buffer is large enough */
-    if (rec->reclen > sizeof (recordbuf))
+    if ((rv = scanheaders (fileidx, recmap, stats, builder)) > 0)
     {
-      ms_log (2, "Record length (%d bytes) larger than buffer (%llu bytes)\n",
-              rec->reclen, (long long unsigned int)sizeof (recordbuf));
-      errflag = 1;
-      break;
-    }
-
-    /* Open file for reading if not already done */
-    if (!rec->flp->infp)
-      if (!(rec->flp->infp = fopen (rec->flp->infilename, "rb")))
-      {
-        ms_log (2, "Cannot open '%s' for reading: %s\n",
-                rec->flp->infilename, strerror (errno));
-        errflag = 1;
-        break;
-      }
+      if (verbose > 1)
+        ms_log (1, "Using full record parsing for %s\n", fileindex[fileidx]->infilename);
 
-    /* Seek to record offset */
-    if (lmp_fseeko (rec->flp->infp, rec->offset, SEEK_SET) == -1)
-    {
-      ms_log (2, "Cannot seek in '%s': %s\n",
-              rec->flp->infilename, strerror (errno));
-      errflag = 1;
-      break;
+      /* Discard any partial results before scanning again */
+      recmap->recordcnt = recordcnt;
+      memset (stats, 0, sizeof (ScanStats));
+      resetindex (builder);
     }
+  }
 
-    /* Read record into buffer */
-    if (fread (recordbuf, rec->reclen, 1, rec->flp->infp) != 1)
-    {
-      ms_log (2, "Cannot read %d bytes at offset %llu from '%s'\n",
-              rec->reclen, (long long unsigned)rec->offset,
-              rec->flp->infilename);
-      errflag = 1;
-      break;
-    }
+  if (rv > 0)
+    rv = scanrecords (fileidx, recmap, stats, builder);
 
-    if (verbose > 1)
-    {
-      char srcname[50];
-      char timestr[50];
-      ms_recsrcname (recordbuf, srcname, 0);
-      ms_hptime2isotimestr (rec->starttime, timestr, 1);
-      ms_log (1, "Writing %s %s\n", srcname, timestr);
-    }
+  /* Write index for later use, failure is not critical */
+  if (builder)
+  {
+    if (rv == 0)
+      writeindex (builder, fileidx, &sbuf);
 
-    if (streamdelay)
-    {
-      hptime_t snooze;
-      now = gethptime ();
+    freeindex (builder);
+  }
 
-      /* Calculate offset between initial packet and current time */
-      if (offset == HPTERROR)
-        offset = now - rec->endtime;
+  return rv;
+} /* End of scanfile() */
 
-      snooze = offset - (now - rec->endtime);
+/***************************************************************************
+ * scanheaders:
+ *
+ * Header-only scanner: read a single input file in large blocks
+ * using a RecordCursor, which extracts only the values needed for
+ * the record index directly from the raw headers.  No MSRecord is
+ * unpacked and nothing is allocated per record.
+ *
+ * If an IndexBuilder is supplied all records are added to it.
+ *
+ * Returns 0 on success, -1 on error and 1 if the file is not
+ * supported by this scanner (e.g. packed files).
+ ***************************************************************************/
+static int
+scanheaders (uint32_t fileidx, RecordMap *recmap, ScanStats *stats,
+             IndexBuilder *builder)
+{
+  RecordCursor cursor;
+  RecordHeader hdr;
+  off_t offset;
+  int detlen;
+  int retval = 0;
+  int rv;
 
-      if (snooze > 0)
-      {
-        if (verbose > 1)
-          ms_log (1, "Sleeping %.2f seconds to simulate streaming\n",
-                  (double)MS_HPTIME2EPOCH (snooze / delayfactor));
+  if (cursoropen (&cursor, fileindex[fileidx], SCANBUFSIZE))
+    return -1;
 
-        dlp_usleep ((unsigned long int)(snooze / delayfactor + 0.5));
-      }
-    }
+  while ((rv = cursornext (&cursor, &hdr, &offset, &detlen, NULL)) == 0)
+  {
+    stats->scanned++;
 
-    /* Write to a single output file if specified */
-    if (ofp)
+    if (verbose > 2)
     {
-      if (fwrite (recordbuf, rec->reclen, 1, ofp) != 1)
-      {
-        ms_log (2, "Cannot write to '%s'\n", outputfile);
-        errflag = 1;
-        break;
-      }
+      char stime[30];
+      ms_hptime2seedtimestr (hdr.starttime, stime, 1);
+      ms_log (1, "%s, %d bytes, %lld samples, %s\n", hdr.srcname, detlen,
+              (long long int)hdr.samplecnt, stime);
     }
 
-    /* Send to DataLink server if specified */
-    if (dlconn)
+    if (builder && indexadd (builder, offset, detlen, hdr.srcname,
+                             hdr.starttime, hdr.endtime, hdr.samplecnt))
     {
-      while (sendrecord (recordbuf, rec))
-      {
-        if (verbose)
-          ms_log (1, "Re-connecting to DataLink server\n");
-
-        /* Re-connect to DataLink server and sleep if error connecting */
-        if (dlconn->link != -1)
-          dl_disconnect (dlconn);
-
-        if (dl_connect (dlconn) < 0)
-        {
-          ms_log (2, "Error re-connecting to DataLink server, sleeping 10 seconds\n");
-          sleep (10);
-        }
-      }
+      rv = -1;
+      break;
     }
 
-    totalrecsout++;
-    totalbytesout += rec->reclen;
-
-    rec = rec->next;
-  } /* Done looping through records */
-
-  /* Close all open input & output files */
-  flp = filelist;
-  while (flp)
-  {
-    if (flp->infp)
-    {
-      fclose (flp->infp);
-      flp->infp = 0;
-    }
+    if ((rv = selectrecord (recmap, fileidx, offset, detlen, hdr.srcname,
+                            hdr.starttime, hdr.endtime)) < 0)
+      break;
 
-    flp = flp->next;
+    if (rv)
+      stats->samplecnt += hdr.samplecnt;
   }
 
-  /* Close output file if used */
-  if (ofp)
-  {
-    fclose (ofp);
-    ofp = 0;
-  }
+  /* Packed files are not supported, signal fallback */
+  if (rv == 2)
+    retval = 1;
+  else if (rv < 0)
+    retval = -1;
 
-  if (verbose)
+  if (retval == 0 && stats->scanned == 0)
   {
-    ms_log (1, "Wrote %llu bytes of %llu records to output\n",
-            totalbytesout, totalrecsout);
+    ms_log (2, "Cannot read %s: %s\n", cursor.flp->infilename, ms_errorstr (MS_NOTSEED));
+    retval = -1;
   }
 
-  return (errflag) ? 1 : 0;
-} /* End of writerecords() */
+  cursorclose (&cursor);
+
+  return retval;
+} /* End of scanheaders() */
 
 /***************************************************************************
- * sendrecord:
+ * cursoropen:
  *
- * Send the specified record to the DataLink server.
+ * Initialize a RecordCursor for reading records from an input file.
+ * Memory mapped files are read directly from the mapping, otherwise
+ * the file is opened and a read buffer of bufsize bytes is allocated.
+ * The buffer is grown if needed to contain records larger than a
+ * quarter of bufsize.
  *
- * Returns 0 on success, and -1 on failure
+ * Returns 0 on success and -1 on error.
  ***************************************************************************/
 static int
-sendrecord (char *recbuf, Record *rec)
+cursoropen (RecordCursor *cursor, Filelink *flp, size_t bufsize)
 {
-  char streamid[100];
-
-  if (!recbuf || !rec)
+  if (!cursor || !flp)
     return -1;
 
-  /* Generate stream ID for this record: NET_STA_LOC_CHAN/MSEED */
-  ms_recsrcname (recbuf, streamid, 0);
-  strcat (streamid, "/MSEED");
+  memset (cursor, 0, sizeof (RecordCursor));
+  cursor->flp = flp;
+
+  if (flp->map)
+  {
+    cursor->buffer = flp->map;
+    cursor->buflen = flp->mapsize;
+    cursor->eof    = 1;
+    return 0;
+  }
+
+  if (!(cursor->fp = fopen (flp->infilename, "rb")))
+  {
+    ms_log (2, "Cannot open file: %s (%s)\n", flp->infilename, strerror (errno));
+    return -1;
+  }
 
-  /* Send record to server */
-  if (dl_write (dlconn, recbuf, rec->reclen, streamid,
-                rec->starttime, rec->endtime, 0) < 0)
+  if (!(cursor->buffer = (char *)malloc (bufsize)))
   {
+    ms_log (2, "Cannot allocate memory for scan buffer\n");
+    fclose (cursor->fp);
+    cursor->fp = NULL;
     return -1;
   }
 
+  cursor->bufsize = bufsize;
+
   return 0;
-} /* End of sendrecord() */
+} /* End of cursoropen() */
 
 /***************************************************************************
- * sortrecmap():
+ * cursorfill:
  *
- * Sort a RecordMap so that records are in time order using a
- * mergesort algorithm.
+ * Move unread data to the start of the buffer of a RecordCursor,
+ * growing the buffer to at least minsize bytes if needed, and fill
+ * the remainder of the buffer from the file.
  *
- * The mergesort implementation was inspired by the listsort function
- * published and copyright 2001 by Simon Tatham.
- *
- * Return 0 on success and -1 on error.
+ * Returns 0 on success and -1 on error.
  ***************************************************************************/
 static int
-sortrecmap (RecordMap *recmap)
+cursorfill (RecordCursor *cursor, size_t minsize)
 {
-  Record *p, *q, *e, *top, *tail;
-  int nmerges;
-  int insize, psize, qsize, i;
-
-  if (!recmap)
-    return -1;
+  size_t avail = cursor->buflen - cursor->bufpos;
+  size_t readcount;
+  char *buffer;
 
-  if (!recmap->first || !recmap->last) /* Done if empty */
-    return 0;
+  if (cursor->bufpos > 0)
+  {
+    memmove (cursor->buffer, cursor->buffer + cursor->bufpos, avail);
+    cursor->bufstart += cursor->bufpos;
+    cursor->bufpos = 0;
+    cursor->buflen = avail;
+  }
 
-  top    = recmap->first;
-  insize = 1;
+  if (minsize > cursor->bufsize)
+  {
+    if (!(buffer = (char *)realloc (cursor->buffer, minsize)))
+    {
+      ms_log (2, "Cannot allocate memory for scan buffer\n");
+      return -1;
+    }
+
+    cursor->buffer  = buffer;
+    cursor->bufsize = minsize;
+  }
+
+  readcount = fread (cursor->buffer + cursor->buflen, 1,
+                     cursor->bufsize - cursor->buflen, cursor->fp);
+
+  if (readcount < cursor->bufsize - cursor->buflen)
+  {
+    if (ferror (cursor->fp))
+    {
+      ms_log (2, "Cannot read %s: %s\n", cursor->flp->infilename, strerror (errno));
+      return -1;
+    }
+
+    cursor->eof = 1;
+  }
+
+  cursor->buflen += readcount;
+
+  return 0;
+} /* End of cursorfill() */
+
+/***************************************************************************
+ * cursornext:
+ *
+ * Return the next data record from a RecordCursor.  Records are
+ * detected with ms_detect() and the values needed for the record
+ * index are extracted from the raw header with parseheader().
+ *
+ * Non-data records and noise are skipped in MINRECLEN increments in
+ * the same manner as ms_readmsr_main().
+ *
+ * The header values, file offset and length of the record are
+ * returned in hdr, offset and recordlen.  If record is not NULL it is
+ * set to the record in the buffer, which remains valid until the next
+ * call.
+ *
+ * Returns 0 when a record is returned, 1 at end of file, 2 if the
+ * file is not supported (e.g. packed files) and -1 on error.
+ ***************************************************************************/
+static int
+cursornext (RecordCursor *cursor, RecordHeader *hdr, off_t *offset,
+            int *recordlen, char **record)
+{
+  char *recptr;
+  size_t avail;
+  off_t recoffset;
+  int detlen;
+
+  if (!cursor || !hdr || !offset || !recordlen)
+    return -1;
+
+  for (;;)
+  {
+    avail = cursor->buflen - cursor->bufpos;
+
+    /* Refill buffer when less than a quarter remains */
+    if (cursor->fp && !cursor->eof && avail < cursor->bufsize / 4)
+    {
+      if (cursorfill (cursor, 0))
+        return -1;
+
+      avail = cursor->buflen - cursor->bufpos;
+    }
+
+    /* Finished when less than a minimum record remains */
+    if (avail < MINRECLEN)
+      return 1;
+
+    recptr    = cursor->buffer + cursor->bufpos;
+    recoffset = cursor->bufstart + (off_t)cursor->bufpos;
+
+    /* Packed files are not supported */
+    if (recoffset == 0 && *recptr == 'P' &&
+        (!memcmp ("PED", recptr, 3) || !memcmp ("PSD", recptr, 3) ||
+         !memcmp ("PLC", recptr, 3) || !memcmp ("PQI", recptr, 3) ||
+         !memcmp ("PLS", recptr, 3)))
+      return 2;
+
+    detlen = ms_detect (recptr, (avail > MAXRECLEN) ? MAXRECLEN : (int)avail);
+
+    /* Grow buffer and retry if length could not be determined or the
+     * record is not complete in a small buffer */
+    if (cursor->fp && !cursor->eof &&
+        ((detlen == 0 && avail < MAXRECLEN) || (detlen > 0 && (size_t)detlen > avail)))
+    {
+      if (cursorfill (cursor, (detlen > 0) ? 4 * (size_t)detlen : SCANBUFSIZE))
+        return -1;
+
+      continue;
+    }
+
+    /* Record length not found, implied by end of file if valid */
+    if (detlen == 0 && cursor->eof)
+    {
+      if (avail <= MAXRECLEN && (avail & (avail - 1)) == 0)
+      {
+        detlen = (int)avail;
+      }
+      else
+      {
+        if (verbose)
+          ms_log (1, "Truncated record at byte offset %lld: %s\n",
+                  (long long int)recoffset, cursor->flp->infilename);
+        return 1;
+      }
+    }
+
+    /* Skip non-data, undetermined length and out of range records */
+    if (detlen < MINRECLEN || detlen > MAXRECLEN)
+    {
+      if (verbose > 3)
+        ms_log (1, "Skipped %d bytes of non-data record at byte offset %lld\n",
+                MINRECLEN, (long long int)recoffset);
+
+      cursor->bufpos += MINRECLEN;
+      continue;
+    }
+
+    /* Truncated record at end of file */
+    if ((size_t)detlen > avail)
+    {
+      if (verbose)
+        ms_log (1, "Truncated record at byte offset %lld: %s\n",
+                (long long int)recoffset, cursor->flp->infilename);
+      return 1;
+    }
+
+    if (parseheader (recptr, detlen, hdr))
+    {
+      ms_log (2, "Cannot parse record header at byte offset %lld: %s\n",
+              (long long int)recoffset, cursor->flp->infilename);
+      return -1;
+    }
+
+    cursor->bufpos += detlen;
+
+    *offset    = recoffset;
+    *recordlen = detlen;
+    if (record)
+      *record = recptr;
+
+    return 0;
+  }
+} /* End of cursornext() */
+
+/***************************************************************************
+ * cursorclose:
+ *
+ * Close the file and free the buffer of a RecordCursor.
+ ***************************************************************************/
+static void
+cursorclose (RecordCursor *cursor)
+{
+  if (!cursor)
+    return;
+
+  if (cursor->fp)
+  {
+    free (cursor->buffer);
+    fclose (cursor->fp);
+  }
+
+  cursor->fp     = NULL;
+  cursor->buffer = NULL;
+} /* End of cursorclose() */
+
+/***************************************************************************
+ * scanrecords:
+ *
+ * Read a single input file using the libmseed record reader, which
+ * fully parses each record, and add entries to the RecordMap for
+ * records that match the selection criteria.
+ *
+ * If an IndexBuilder is supplied all records are added to it.
+ *
+ * Returns 0 on success and -1 otherwise.
+ ***************************************************************************/
+static int
+scanrecords (uint32_t fileidx, RecordMap *recmap, ScanStats *stats,
+             IndexBuilder *builder)
+{
+  MSFileParam *msfp = NULL;
+  Filelink *flp;
+  MSRecord *msr = 0;
+
+  off_t fpos = 0;
+  char srcname[50];
+
+  int retcode;
+  int rv;
+
+  flp = fileindex[fileidx];
+
+  /* Loop over the input file */
+  while ((retcode = ms_readmsr_main (&msfp, &msr, flp->infilename, reclen, &fpos, NULL, 1, 0, NULL, verbose - 2)) == MS_NOERROR)
+  {
+    stats->scanned++;
+
+    /* Generate the srcname with the quality code */
+    msr_srcname (msr, srcname, 1);
+
+    if (verbose > 2)
+      msr_print (msr, verbose - 3);
+
+    if (builder && indexadd (builder, fpos, msr->reclen, srcname, msr->starttime,
+                             msr_endtime (msr), msr->samplecnt))
+    {
+      ms_readmsr_main (&msfp, &msr, NULL, 0, NULL, NULL, 0, 0, NULL, 0);
+      return -1;
+    }
+
+    if ((rv = selectrecord (recmap, fileidx, fpos, msr->reclen, srcname,
+                            msr->starttime, msr_endtime (msr))) < 0)
+    {
+      ms_readmsr_main (&msfp, &msr, NULL, 0, NULL, NULL, 0, 0, NULL, 0);
+      return -1;
+    }
+
+    if (rv)
+      stats->samplecnt += msr->samplecnt;
+  } /* End of looping through records in file */
+
+  /* Critical error if file was not read properly */
+  if (retcode != MS_ENDOFFILE)
+  {
+    ms_log (2, "Cannot read %s: %s\n", flp->infilename, ms_errorstr (retcode));
+    ms_readmsr_main (&msfp, &msr, NULL, 0, NULL, NULL, 0, 0, NULL, 0);
+    return -1;
+  }
+
+  /* Make sure everything is cleaned up */
+  ms_readmsr_main (&msfp, &msr, NULL, 0, NULL, NULL, 0, 0, NULL, 0);
+
+  return 0;
+} /* End of scanrecords() */
+
+/***************************************************************************
+ * selectrecord:
+ *
+ * Apply the time and source name selection criteria to a record and
+ * add a Record entry to the RecordMap if it is selected.
+ *
+ * Returns 1 if the record was added, 0 if it was skipped and -1 on
+ * error.
+ ***************************************************************************/
+static int
+selectrecord (RecordMap *recmap, uint32_t fileidx, off_t offset, int recordlen,
+              const char *srcname, hptime_t recstarttime, hptime_t recendtime)
+{
+  const char *skip;
+  char stime[30];
+
+  if (!(skip = timeskip (recstarttime, recendtime)))
+    skip = sourceskip (srcname);
+
+  if (skip)
+  {
+    if (verbose >= 3)
+    {
+      ms_hptime2seedtimestr (recstarttime, stime, 1);
+      ms_log (1, "Skipping (%s) %s, %s\n", skip, srcname, stime);
+    }
+    return 0;
+  }
+
+  return addselected (recmap, fileidx, offset, recordlen, recstarttime, recendtime);
+} /* End of selectrecord() */
+
+/***************************************************************************
+ * timeskip:
+ *
+ * Check a record time range against the time selection criteria.
+ *
+ * Returns NULL if the record is selected, otherwise a description of
+ * the criterion by which it is skipped.
+ ***************************************************************************/
+static const char *
+timeskip (hptime_t recstarttime, hptime_t recendtime)
+{
+  /* Check if record matches start time criteria: starts after or contains starttime */
+  if ((starttime != HPTERROR) && (recstarttime < starttime && !(recstarttime <= starttime && recendtime >= starttime)))
+    return "starttime";
+
+  /* Check if record matches end time criteria: ends after or contains endtime */
+  if ((endtime != HPTERROR) && (recendtime > endtime && !(recstarttime <= endtime && recendtime >= endtime)))
+    return "endtime";
+
+  return NULL;
+} /* End of timeskip() */
+
+/***************************************************************************
+ * sourceskip:
+ *
+ * Check a source name against the match and reject expressions.
+ *
+ * Returns NULL if the source is selected, otherwise a description of
+ * the criterion by which it is skipped.
+ ***************************************************************************/
+static const char *
+sourceskip (const char *srcname)
+{
+  /* Check if record is matched by the match regex */
+  if (match && regexec (match, srcname, 0, 0, 0) != 0)
+    return "match";
+
+  /* Check if record is rejected by the reject regex */
+  if (reject && regexec (reject, srcname, 0, 0, 0) == 0)
+    return "reject";
+
+  return NULL;
+} /* End of sourceskip() */
+
+/***************************************************************************
+ * addselected:
+ *
+ * Add and populate a new Record entry for a selected record.
+ *
+ * Returns 1 on success and -1 on error.
+ ***************************************************************************/
+static int
+addselected (RecordMap *recmap, uint32_t fileidx, off_t offset, int recordlen,
+             hptime_t recstarttime, hptime_t recendtime)
+{
+  Record *rec;
+
+  if (!(rec = addrecord (recmap)))
+    return -1;
+
+  if (packrecord (rec, fileidx, offset, recordlen))
+  {
+    ms_log (2, "Cannot index record at offset %llu (%d bytes) in %s\n",
+            (long long unsigned int)offset, recordlen, fileindex[fileidx]->infilename);
+    recmap->recordcnt--;
+    return -1;
+  }
+
+  rec->starttime = recstarttime;
+  rec->endtime   = recendtime;
+
+  return 1;
+} /* End of addselected() */
+
+/***************************************************************************
+ * parseheader:
+ *
+ * Extract the source name, start time, end time and sample count
+ * from a raw miniSEED record header without unpacking the record.
+ * The values are determined in the same way as by msr_unpack(),
+ * msr_starttime() and msr_endtime(): the time correction is applied
+ * if not already applied and the sample rate and microsecond offset
+ * of Blockettes 100 and 1001 are used if present.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+static int
+parseheader (const char *record, int recordlen, RecordHeader *hdr)
+{
+  struct fsdh_s fsdh;
+  struct blkt_100_s blkt_100;
+  struct blkt_1001_s blkt_1001;
+  LeapSecond *lslist = leapsecondlist;
+  uint16_t blkt_offset;
+  uint16_t blkt_type;
+  uint16_t next_blkt;
+  double samprate = -1.0;
+  hptime_t span   = 0;
+  int swapflag;
+  char *cp;
+
+  if (!record || !hdr || recordlen < (int)sizeof (struct fsdh_s))
+    return -1;
+
+  memcpy (&fsdh, record, sizeof (struct fsdh_s));
+
+  /* Check to see if byte swapping is needed by testing the year and day */
+  swapflag = (!MS_ISVALIDYEARDAY (fsdh.start_time.year, fsdh.start_time.day)) ? 1 : 0;
+
+  if (swapflag)
+  {
+    MS_SWAPBTIME (&fsdh.start_time);
+    ms_gswap2 (&fsdh.numsamples);
+    ms_gswap2 (&fsdh.samprate_fact);
+    ms_gswap2 (&fsdh.samprate_mult);
+    ms_gswap4 (&fsdh.time_correct);
+    ms_gswap2 (&fsdh.blockette_offset);
+  }
+
+  /* Build source name: NET_STA_LOC_CHAN_QUAL */
+  cp = hdr->srcname;
+  ms_strncpcleantail (cp, fsdh.network, 2);
+  cp += strlen (cp);
+  *cp++ = '_';
+  ms_strncpcleantail (cp, fsdh.station, 5);
+  cp += strlen (cp);
+  *cp++ = '_';
+  ms_strncpcleantail (cp, fsdh.location, 2);
+  cp += strlen (cp);
+  *cp++ = '_';
+  ms_strncpcleantail (cp, fsdh.channel, 3);
+  cp += strlen (cp);
+  *cp++ = '_';
+  *cp++ = fsdh.dataquality;
+  *cp   = '\0';
+
+  if ((hdr->starttime = ms_btime2hptime (&fsdh.start_time)) == HPTERROR)
+    return -1;
+
+  /* Apply time correction if included and not already applied */
+  if (fsdh.time_correct != 0 && !(fsdh.act_flags & 0x02))
+    hdr->starttime += (hptime_t)fsdh.time_correct * (HPTMODULUS / 10000);
+
+  /* Traverse the blockettes for Blockettes 100 and 1001 */
+  blkt_offset = fsdh.blockette_offset;
+
+  while (blkt_offset != 0 && (int)blkt_offset + 4 <= recordlen)
+  {
+    memcpy (&blkt_type, record + blkt_offset, 2);
+    memcpy (&next_blkt, record + blkt_offset + 2, 2);
+
+    if (swapflag)
+    {
+      ms_gswap2 (&blkt_type);
+      ms_gswap2 (&next_blkt);
+    }
+
+    if (blkt_type == 100 &&
+        (int)(blkt_offset + 4 + sizeof (struct blkt_100_s)) <= recordlen)
+    {
+      memcpy (&blkt_100, record + blkt_offset + 4, sizeof (struct blkt_100_s));
+
+      if (swapflag)
+        ms_gswap4 (&blkt_100.samprate);
+
+      samprate = (double)blkt_100.samprate;
+    }
+    else if (blkt_type == 1001 &&
+             (int)(blkt_offset + 4 + sizeof (struct blkt_1001_s)) <= recordlen)
+    {
+      memcpy (&blkt_1001, record + blkt_offset + 4, sizeof (struct blkt_1001_s));
+
+      hdr->starttime += (hptime_t)blkt_1001.usec * (HPTMODULUS / 1000000);
+    }
+
+    /* Stop at invalid next blockette offset */
+    if (next_blkt != 0 && (next_blkt < 4 || (next_blkt - 4) <= blkt_offset))
+      break;
+
+    blkt_offset = next_blkt;
+  }
+
+  if (samprate < 0.0)
+    samprate = ms_nomsamprate (fsdh.samprate_fact, fsdh.samprate_mult);
+
+  hdr->samplecnt = fsdh.numsamples;
+
+  if (samprate > 0.0 && hdr->samplecnt > 0)
+    span = (hptime_t)(((double)(hdr->samplecnt - 1) / samprate * HPTMODULUS) + 0.5);
+
+  /* Check if the record contains a leap second, if list is available,
+   * otherwise reduce span if a leap second is flagged in the record */
+  if (lslist)
+  {
+    for (; lslist; lslist = lslist->next)
+    {
+      if (lslist->leapsecond > hdr->starttime &&
+          lslist->leapsecond <= (hdr->starttime + span - HPTMODULUS))
+      {
+        span -= HPTMODULUS;
+        break;
+      }
+    }
+  }
+  else if (fsdh.act_flags & 0x10)
+  {
+    span -= HPTMODULUS;
+  }
+
+  hdr->endtime = hdr->starttime + span;
+
+  return 0;
+} /* End of parseheader() */
+
+/***************************************************************************
+ * retimerecord:
+ *
+ * Shift the start time of a raw miniSEED record in place by rewriting
+ * the BTime start time in the fixed header and the microsecond offset
+ * of Blockette 1001, if present, without unpacking the record.  The
+ * time correction is left unchanged and applies to the shifted time.
+ *
+ * Without Blockette 1001 the start time is truncated to the BTime
+ * resolution of 100 microseconds.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+static int
+retimerecord (char *record, int recordlen, hptime_t shift)
+{
+  struct fsdh_s fsdh;
+  BTime btime;
+  hptime_t hptime;
+  uint16_t blkt_offset;
+  uint16_t blkt_type;
+  uint16_t next_blkt;
+  int8_t usec = 0;
+  int usecpos = 0;
+  int swapflag;
+
+  if (!record || recordlen < (int)sizeof (struct fsdh_s))
+    return -1;
+
+  memcpy (&fsdh, record, sizeof (struct fsdh_s));
+
+  /* Check to see if byte swapping is needed by testing the year and day */
+  swapflag = (!MS_ISVALIDYEARDAY (fsdh.start_time.year, fsdh.start_time.day)) ? 1 : 0;
+
+  if (swapflag)
+  {
+    MS_SWAPBTIME (&fsdh.start_time);
+    ms_gswap2 (&fsdh.blockette_offset);
+  }
+
+  /* Find the microsecond offset of Blockette 1001 */
+  blkt_offset = fsdh.blockette_offset;
+
+  while (blkt_offset != 0 && (int)blkt_offset + 4 <= recordlen)
+  {
+    memcpy (&blkt_type, record + blkt_offset, 2);
+    memcpy (&next_blkt, record + blkt_offset + 2, 2);
+
+    if (swapflag)
+    {
+      ms_gswap2 (&blkt_type);
+      ms_gswap2 (&next_blkt);
+    }
+
+    if (blkt_type == 1001 &&
+        (int)(blkt_offset + 4 + sizeof (struct blkt_1001_s)) <= recordlen)
+    {
+      usecpos = blkt_offset + 4 + offsetof (struct blkt_1001_s, usec);
+      usec    = (int8_t)record[usecpos];
+      break;
+    }
+
+    /* Stop at invalid next blockette offset */
+    if (next_blkt != 0 && (next_blkt < 4 || (next_blkt - 4) <= blkt_offset))
+      break;
+
+    blkt_offset = next_blkt;
+  }
+
+  if ((hptime = ms_btime2hptime (&fsdh.start_time)) == HPTERROR)
+    return -1;
+
+  hptime += (hptime_t)usec * (HPTMODULUS / 1000000) + shift;
+
+  if (ms_hptime2btime (hptime, &btime))
+    return -1;
+
+  /* Remainder below BTime resolution, 0 to 99 microseconds */
+  usec = (int8_t)((hptime - ms_btime2hptime (&btime)) / (HPTMODULUS / 1000000));
+
+  if (swapflag)
+  {
+    MS_SWAPBTIME (&btime);
+  }
+
+  memcpy (record + offsetof (struct fsdh_s, start_time), &btime, sizeof (BTime));
+
+  if (usecpos)
+    record[usecpos] = (char)usec;
+
+  return 0;
+} /* End of retimerecord() */
+
+/***************************************************************************
+ * loadindex:
+ *
+ * Select records from the index file of an input file if the index
+ * exists and is current, i.e. matches the size and modification time
+ * of the input file.  The index is memory mapped, the source name
+ * selection criteria are evaluated once for each source name and the
+ * time criteria for each entry.
+ *
+ * Returns 0 if records were selected from the index, 1 if no current
+ * index is available and -1 on error.
+ ***************************************************************************/
+static int
+loadindex (uint32_t fileidx, struct stat *sbuf, RecordMap *recmap, ScanStats *stats)
+{
+  Filelink *flp = fileindex[fileidx];
+  IndexHeader *header;
+  IndexEntry *entry;
+  const char **srcskip = NULL;
+  const char *skip;
+  const char *srcname;
+  char path[1024];
+  char stime[30];
+  struct stat ibuf;
+  uint64_t idx;
+  size_t expected;
+  void *map;
+  int fd;
+  int retval = 0;
+
+  if (!indexpath (flp->infilename, path, sizeof (path)))
+    return 1;
+
+  if ((fd = open (path, O_RDONLY)) < 0)
+    return 1;
+
+  if (fstat (fd, &ibuf) || ibuf.st_size < (off_t)sizeof (IndexHeader))
+  {
+    close (fd);
+    return 1;
+  }
+
+  map = mmap (NULL, (size_t)ibuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+
+  if (map == MAP_FAILED)
+    return 1;
+
+  header   = (IndexHeader *)map;
+  expected = sizeof (IndexHeader) + (size_t)header->srccount * INDEXSRCLEN +
+             (size_t)header->recordcount * sizeof (IndexEntry);
+
+  /* Validate index against format and input file */
+  if (memcmp (header->magic, INDEXMAGIC, sizeof (header->magic)) ||
+      header->byteorder != INDEXBYTEORDER ||
+      header->filesize != (uint64_t)sbuf->st_size ||
+      header->filemtime != (int64_t)sbuf->st_mtime ||
+      expected != (size_t)ibuf.st_size)
+  {
+    if (verbose > 1)
+      ms_log (1, "Index is not current, re-scanning %s\n", flp->infilename);
+
+    munmap (map, (size_t)ibuf.st_size);
+    return 1;
+  }
+
+  /* Validate entries before adding any records, a corrupt index is
+   * treated as stale */
+  entry = (IndexEntry *)((char *)map + sizeof (IndexHeader) + (size_t)header->srccount * INDEXSRCLEN);
+
+  for (idx = 0; idx < header->recordcount; idx++, entry++)
+  {
+    if (entry->srcid >= header->srccount ||
+        entry->reclenexp < 7 || entry->reclenexp > 20 ||
+        ((uint64_t)1 << entry->reclenexp) > (uint64_t)sbuf->st_size ||
+        entry->offset > (uint64_t)sbuf->st_size - ((uint64_t)1 << entry->reclenexp))
+    {
+      if (verbose > 1)
+        ms_log (1, "Index entry %llu is invalid, re-scanning %s\n",
+                (long long unsigned int)idx, flp->infilename);
+
+      munmap (map, (size_t)ibuf.st_size);
+      return 1;
+    }
+  }
+
+  if (verbose > 1)
+    ms_log (1, "Reading %llu records from index %s\n",
+            (long long unsigned int)header->recordcount, path);
+
+  if (header->srccount > 0 &&
+      !(srcskip = (const char **)malloc (header->srccount * sizeof (char *))))
+  {
+    ms_log (2, "Cannot allocate memory for index\n");
+    munmap (map, (size_t)ibuf.st_size);
+    return -1;
+  }
+
+  /* Evaluate source name criteria once per source */
+  for (idx = 0; idx < header->srccount; idx++)
+  {
+    srcname      = (const char *)map + sizeof (IndexHeader) + idx * INDEXSRCLEN;
+    srcskip[idx] = sourceskip (srcname);
+  }
+
+  entry = (IndexEntry *)((char *)map + sizeof (IndexHeader) + (size_t)header->srccount * INDEXSRCLEN);
+
+  for (idx = 0; idx < header->recordcount; idx++, entry++)
+  {
+    stats->scanned++;
+    stats->indexed++;
+
+    if (!(skip = timeskip (entry->starttime, entry->endtime)))
+      skip = srcskip[entry->srcid];
+
+    if (skip)
+    {
+      if (verbose >= 3)
+      {
+        ms_hptime2seedtimestr (entry->starttime, stime, 1);
+        ms_log (1, "Skipping (%s) %s, %s\n", skip,
+                (const char *)map + sizeof (IndexHeader) + (size_t)entry->srcid * INDEXSRCLEN,
+                stime);
+      }
+      continue;
+    }
+
+    if (addselected (recmap, fileidx, (off_t)entry->offset, 1 << entry->reclenexp,
+                     entry->starttime, entry->endtime) < 0)
+    {
+      retval = -1;
+      break;
+    }
+
+    stats->samplecnt += entry->samplecnt;
+  }
+
+  free (srcskip);
+  munmap (map, (size_t)ibuf.st_size);
+
+  return retval;
+} /* End of loadindex() */
+
+/***************************************************************************
+ * indexadd:
+ *
+ * Add a record entry to an IndexBuilder, adding the source name to
+ * the source name table if not already present.  Records that cannot
+ * be represented in an index, i.e. with a record length that is not a
+ * power of 2, mark the index as unindexable.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+static int
+indexadd (IndexBuilder *builder, off_t offset, int recordlen, const char *srcname,
+          hptime_t recstarttime, hptime_t recendtime, int64_t samplecnt)
+{
+  IndexEntry *entry;
+  uint32_t hash = 2166136261u;
+  uint32_t slot;
+  uint32_t idx;
+  const char *cp;
+  int exponent;
+
+  if (!builder || !srcname)
+    return -1;
+
+  if (builder->unindexable)
+    return 0;
+
+  for (exponent = 7; exponent <= 20; exponent++)
+    if ((1 << exponent) == recordlen)
+      break;
+
+  if (exponent > 20 || samplecnt < 0 || samplecnt > UINT16_MAX ||
+      strlen (srcname) >= INDEXSRCLEN)
+  {
+    builder->unindexable = 1;
+    return 0;
+  }
+
+  /* Grow hash table to keep load below 50% */
+  if (builder->srccount * 2 >= builder->hashsize)
+  {
+    uint32_t newsize = (builder->hashsize) ? builder->hashsize * 2 : 256;
+    uint32_t *newtable;
+
+    if (!(newtable = (uint32_t *)calloc (newsize, sizeof (uint32_t))))
+    {
+      ms_log (2, "Cannot allocate memory for index\n");
+      return -1;
+    }
+
+    for (idx = 0; idx < builder->srccount; idx++)
+    {
+      hash = 2166136261u;
+      for (cp = builder->srcnames + (size_t)idx * INDEXSRCLEN; *cp; cp++)
+        hash = (hash ^ (uint8_t)*cp) * 16777619u;
+
+      for (slot = hash & (newsize - 1); newtable[slot]; slot = (slot + 1) & (newsize - 1))
+        ;
+      newtable[slot] = idx + 1;
+    }
+
+    free (builder->hashtable);
+    builder->hashtable = newtable;
+    builder->hashsize  = newsize;
+  }
+
+  /* Find source name in hash table using FNV-1a hash and linear probing */
+  hash = 2166136261u;
+  for (cp = srcname; *cp; cp++)
+    hash = (hash ^ (uint8_t)*cp) * 16777619u;
+
+  for (slot = hash & (builder->hashsize - 1); builder->hashtable[slot];
+       slot = (slot + 1) & (builder->hashsize - 1))
+  {
+    if (!strcmp (builder->srcnames + (size_t)(builder->hashtable[slot] - 1) * INDEXSRCLEN, srcname))
+      break;
+  }
+
+  /* Add new source name */
+  if (!builder->hashtable[slot])
+  {
+    if (builder->srccount >= builder->srcalloc)
+    {
+      uint32_t newalloc = (builder->srcalloc) ? builder->srcalloc * 2 : 64;
+      char *newnames;
+
+      if (!(newnames = (char *)realloc (builder->srcnames, (size_t)newalloc * INDEXSRCLEN)))
+      {
+        ms_log (2, "Cannot allocate memory for index\n");
+        return -1;
+      }
+
+      builder->srcnames = newnames;
+      builder->srcalloc = newalloc;
+    }
+
+    memset (builder->srcnames + (size_t)builder->srccount * INDEXSRCLEN, 0, INDEXSRCLEN);
+    strcpy (builder->srcnames + (size_t)builder->srccount * INDEXSRCLEN, srcname);
+    builder->hashtable[slot] = ++builder->srccount;
+  }
+
+  if (builder->entrycount >= builder->entryalloc)
+  {
+    uint64_t newalloc = (builder->entryalloc) ? builder->entryalloc * 2 : 1024;
+    IndexEntry *newentries;
+
+    if (!(newentries = (IndexEntry *)realloc (builder->entries, newalloc * sizeof (IndexEntry))))
+    {
+      ms_log (2, "Cannot allocate memory for index\n");
+      return -1;
+    }
+
+    builder->entries    = newentries;
+    builder->entryalloc = newalloc;
+  }
+
+  entry            = &builder->entries[builder->entrycount++];
+  entry->starttime = recstarttime;
+  entry->endtime   = recendtime;
+  entry->offset    = (uint64_t)offset;
+  entry->srcid     = builder->hashtable[slot] - 1;
+  entry->samplecnt = (uint16_t)samplecnt;
+  entry->reclenexp = (uint8_t)exponent;
+  entry->reserved  = 0;
+
+  return 0;
+} /* End of indexadd() */
+
+/***************************************************************************
+ * writeindex:
+ *
+ * Write the index of an input file.  The index is written to a
+ * temporary file and renamed into place to avoid partial indexes.
+ * Failure to write an index is reported but not considered an error.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+static int
+writeindex (IndexBuilder *builder, uint32_t fileidx, struct stat *sbuf)
+{
+  Filelink *flp = fileindex[fileidx];
+  IndexHeader header;
+  char path[1024];
+  char tmppath[1100];
+  FILE *ifp;
+  int failed;
+
+  if (!builder || !sbuf)
+    return -1;
+
+  if (builder->unindexable)
+  {
+    if (verbose)
+      ms_log (1, "Cannot index records of %s, index not written\n", flp->infilename);
+    return -1;
+  }
+
+  if (!indexpath (flp->infilename, path, sizeof (path)))
+  {
+    ms_log (1, "Index file name too long for %s\n", flp->infilename);
+    return -1;
+  }
+
+  snprintf (tmppath, sizeof (tmppath), "%s.%ld", path, (long int)getpid ());
+
+  if (!(ifp = fopen (tmppath, "wb")))
+  {
+    ms_log (1, "Cannot write index %s: %s\n", tmppath, strerror (errno));
+    return -1;
+  }
+
+  memset (&header, 0, sizeof (header));
+  memcpy (header.magic, INDEXMAGIC, sizeof (header.magic));
+  header.byteorder   = INDEXBYTEORDER;
+  header.srccount    = builder->srccount;
+  header.recordcount = builder->entrycount;
+  header.filesize    = (uint64_t)sbuf->st_size;
+  header.filemtime   = (int64_t)sbuf->st_mtime;
+
+  failed = (fwrite (&header, sizeof (header), 1, ifp) != 1);
+
+  if (!failed && builder->srccount)
+    failed = (fwrite (builder->srcnames, INDEXSRCLEN, builder->srccount, ifp) != builder->srccount);
+
+  if (!failed && builder->entrycount)
+    failed = (fwrite (builder->entries, sizeof (IndexEntry), builder->entrycount, ifp) != builder->entrycount);
+
+  if (fclose (ifp))
+    failed = 1;
+
+  if (failed || rename (tmppath, path))
+  {
+    ms_log (1, "Cannot write index %s: %s\n", path, strerror (errno));
+    unlink (tmppath);
+    return -1;
+  }
+
+  if (verbose > 1)
+    ms_log (1, "Wrote index of %llu records to %s\n",
+            (long long unsigned int)builder->entrycount, path);
+
+  return 0;
+} /* End of writeindex() */
+
+/***************************************************************************
+ * resetindex:
+ *
+ * Remove all entries and source names from an IndexBuilder.
+ ***************************************************************************/
+static void
+resetindex (IndexBuilder *builder)
+{
+  if (!builder)
+    return;
+
+  builder->entrycount  = 0;
+  builder->srccount    = 0;
+  builder->unindexable = 0;
+
+  if (builder->hashtable)
+    memset (builder->hashtable, 0, builder->hashsize * sizeof (uint32_t));
+} /* End of resetindex() */
+
+/***************************************************************************
+ * freeindex:
+ *
+ * Free all memory associated with an IndexBuilder.
+ ***************************************************************************/
+static void
+freeindex (IndexBuilder *builder)
+{
+  if (!builder)
+    return;
+
+  free (builder->entries);
+  free (builder->srcnames);
+  free (builder->hashtable);
+  free (builder);
+} /* End of freeindex() */
+
+/***************************************************************************
+ * indexpath:
+ *
+ * Generate the index file path for an input file.  By default the
+ * index is next to the input file with INDEXSUFFIX appended.  If an
+ * index directory is specified the index is placed in that directory
+ * and named by the absolute path of the input file with '%' and '/'
+ * characters escaped as %25 and %2F.
+ *
+ * Returns a pointer to path on success and NULL on error.
+ ***************************************************************************/
+static char *
+indexpath (const char *filename, char *path, size_t pathsize)
+{
+  char realname[PATH_MAX];
+  const char *cp;
+  size_t length;
+
+  if (!filename || !path)
+    return NULL;
+
+  if (!indexdir)
+  {
+    if (snprintf (path, pathsize, "%s%s", filename, INDEXSUFFIX) >= (int)pathsize)
+      return NULL;
+
+    return path;
+  }
+
+  if (!realpath (filename, realname))
+    return NULL;
+
+  if ((length = snprintf (path, pathsize, "%s/", indexdir)) >= pathsize)
+    return NULL;
+
+  for (cp = realname; *cp; cp++)
+  {
+    if (length + 4 >= pathsize)
+      return NULL;
+
+    if (*cp == '/')
+      length += sprintf (path + length, "%%2F");
+    else if (*cp == '%')
+      length += sprintf (path + length, "%%25");
+    else
+      path[length++] = *cp;
+  }
+
+  if (length + strlen (INDEXSUFFIX) >= pathsize)
+    return NULL;
+
+  strcpy (path + length, INDEXSUFFIX);
+
+  return path;
+} /* End of indexpath() */
+
+/***************************************************************************
+ * scanthreaded:
+ *
+ * Scan all input files using a pool of threadcount worker threads.
+ * Each file is scanned into a separate RecordMap, the calling thread
+ * appends each completed file's records to the final RecordMap in
+ * input file order and releases the per-file RecordMap.
+ *
+ * The total count of records scanned and samples in all selected
+ * records are returned in stats.
+ *
+ * Returns 0 on success and -1 otherwise.
+ ***************************************************************************/
+static int
+scanthreaded (RecordMap *recmap, ScanStats *stats)
+{
+  ScanControl scan;
+  ScanResult *result;
+  pthread_t *threads;
+  Record *records;
+  uint32_t fileidx;
+  int nthreads;
+  int started = 0;
+  int idx;
+  int retval = 0;
+
+  if (!recmap || !stats)
+    return -1;
+
+  nthreads = (threadcount < (int)filecount) ? threadcount : (int)filecount;
+
+  memset (&scan, 0, sizeof (scan));
+
+  if (!(scan.results = (ScanResult *)calloc (filecount, sizeof (ScanResult))) ||
+      !(threads = (pthread_t *)malloc (nthreads * sizeof (pthread_t))))
+  {
+    ms_log (2, "Cannot allocate memory for scanning threads\n");
+    free (scan.results);
+    return -1;
+  }
+
+  pthread_mutex_init (&scan.lock, NULL);
+  pthread_cond_init (&scan.done, NULL);
+
+  /* Share the record limit between the final and per-file RecordMaps */
+  if (recmap->limit > 0)
+  {
+    scan.limit    = recmap->limit / (2 * nthreads);
+    recmap->limit = recmap->limit / 2;
+
+    if (scan.limit < RECMAP_MINLIMIT)
+      scan.limit = RECMAP_MINLIMIT;
+  }
+
+  if (verbose > 1)
+    ms_log (1, "Scanning %u input files with %d threads\n", filecount, nthreads);
+
+  for (idx = 0; idx < nthreads; idx++)
+  {
+    if (pthread_create (&threads[idx], NULL, scanworker, &scan))
+    {
+      ms_log (2, "Cannot create scanning thread: %s\n", strerror (errno));
+      retval = -1;
+      break;
+    }
+
+    started++;
+  }
+
+  /* Append per-file results in input file order as they complete */
+  for (fileidx = 0; fileidx < filecount && retval == 0; fileidx++)
+  {
+    result = &scan.results[fileidx];
+
+    pthread_mutex_lock (&scan.lock);
+    while (result->state == 0 && !scan.error && started > 0)
+      pthread_cond_wait (&scan.done, &scan.lock);
+
+    if (result->state != 1)
+      retval = -1;
+    pthread_mutex_unlock (&scan.lock);
+
+    if (retval)
+      break;
+
+    if (result->recmap.recordcnt > 0)
+    {
+      /* Spill before exceeding the memory limit */
+      if (recmap->limit > 0 && recmap->recordcnt + result->recmap.recordcnt > recmap->limit &&
+          spillrecmap (recmap))
+      {
+        retval = -1;
+        break;
+      }
+
+      if (recmap->recordcnt + result->recmap.recordcnt > recmap->allocated)
+      {
+        if (!(records = (Record *)realloc (recmap->records,
+                                           (recmap->recordcnt + result->recmap.recordcnt) * sizeof (Record))))
+        {
+          ms_log (2, "Cannot allocate memory for Record entries\n");
+          retval = -1;
+          break;
+        }
+
+        recmap->records   = records;
+        recmap->allocated = recmap->recordcnt + result->recmap.recordcnt;
+      }
+
+      memcpy (recmap->records + recmap->recordcnt, result->recmap.records,
+              result->recmap.recordcnt * sizeof (Record));
+      recmap->recordcnt += result->recmap.recordcnt;
+    }
+
+    stats->scanned += result->stats.scanned;
+    stats->samplecnt += result->stats.samplecnt;
+    stats->indexed += result->stats.indexed;
+
+    free (result->recmap.records);
+    result->recmap.records = NULL;
+  }
+
+  /* Signal any running workers to stop on error */
+  if (retval)
+  {
+    pthread_mutex_lock (&scan.lock);
+    scan.error = 1;
+    pthread_mutex_unlock (&scan.lock);
+  }
+
+  for (idx = 0; idx < started; idx++)
+    pthread_join (threads[idx], NULL);
+
+  for (fileidx = 0; fileidx < filecount; fileidx++)
+    free (scan.results[fileidx].recmap.records);
+
+  pthread_cond_destroy (&scan.done);
+  pthread_mutex_destroy (&scan.lock);
+  free (scan.results);
+  free (threads);
+
+  return retval;
+} /* End of scanthreaded() */
+
+/***************************************************************************
+ * scanworker:
+ *
+ * Thread routine for scanning input files.  Files are claimed in
+ * input order until all files are claimed or an error is flagged.
+ ***************************************************************************/
+static void *
+scanworker (void *arg)
+{
+  ScanControl *scan = (ScanControl *)arg;
+  ScanResult *result;
+  Record *records;
+  uint32_t fileidx;
+  int rv;
+
+  for (;;)
+  {
+    pthread_mutex_lock (&scan->lock);
+    if (scan->error || scan->nextfile >= filecount)
+    {
+      pthread_mutex_unlock (&scan->lock);
+      break;
+    }
+    fileidx = scan->nextfile++;
+    pthread_mutex_unlock (&scan->lock);
+
+    result = &scan->results[fileidx];
+    result->recmap.limit = scan->limit;
+
+    rv = scanfile (fileidx, &result->recmap, &result->stats);
+
+    /* Trim the per-file record array to release unused memory */
+    if (rv == 0 && result->recmap.allocated > result->recmap.recordcnt)
+    {
+      if (result->recmap.recordcnt == 0)
+      {
+        free (result->recmap.records);
+        result->recmap.records   = NULL;
+        result->recmap.allocated = 0;
+      }
+      else if ((records = (Record *)realloc (result->recmap.records,
+                                             result->recmap.recordcnt * sizeof (Record))))
+      {
+        result->recmap.records   = records;
+        result->recmap.allocated = result->recmap.recordcnt;
+      }
+    }
+
+    pthread_mutex_lock (&scan->lock);
+    result->state = (rv) ? -1 : 1;
+    if (rv)
+      scan->error = 1;
+    pthread_cond_broadcast (&scan->done);
+    pthread_mutex_unlock (&scan->lock);
+  }
+
+  return NULL;
+} /* End of scanworker() */
+
+/***************************************************************************
+ * writerecords():
+ *
+ * Write all records in the RecordMap to output.  If records have been
+ * spilled to disk the sorted runs are merged with the RecordMap.
+ *
+ * When looping the records are written repeatedly, on each pass after
+ * the first the time shift is advanced by the time span of the records
+ * rounded up to the next whole second.
+ *
+ * Returns 0 on success and 1 on error.
+ ***************************************************************************/
+static int
+writerecords (RecordMap *recmap)
+{
+  RunMerger merger;
+  RunMerger *mergerp = NULL;
+  Record rec;
+  OutputFile *ofp = NULL;
+  int64_t recidx;
+  hptime_t span;
+  int retval = 0;
+  int pass;
+  int rv;
+
+  if (!recmap)
+    return 1;
+
+  if (openoutput (&ofp))
+    return 1;
+
+  for (pass = 1; retval == 0; pass++)
+  {
+    mergerp = NULL;
+    recidx  = 0;
+
+    /* Merge spilled runs with the remaining records */
+    if (spillset.runcount > 0)
+    {
+      if (verbose > 1)
+        ms_log (1, "Merging %d spilled runs with %lld records in memory\n",
+                spillset.runcount, (long long int)recmap->recordcnt);
+
+      if (mergeropen (&merger, spillset.runs, spillset.runcount, recmap))
+        retval = 1;
+      else
+        mergerp = &merger;
+    }
+
+    /* Read records ahead of output in separate threads */
+    if (retval == 0 && prefetchslots > 0)
+    {
+      if (prefetchrecords (recmap, mergerp, ofp))
+        retval = 1;
+    }
+    /* Read records in coalesced batches */
+    else if (retval == 0 && batchsize > 0)
+    {
+      if (batchrecords (recmap, mergerp, ofp))
+        retval = 1;
+    }
+    /* Loop through records and send/write records */
+    else if (retval == 0)
+    {
+      while ((rv = nextrecord (recmap, mergerp, &recidx, &rec)) == 0)
+      {
+        if (writerecord (&rec, NULL, ofp))
+        {
+          rv = -1;
+          break;
+        }
+      }
+
+      if (rv > 0 && copyflush (ofp))
+        rv = -1;
+
+      if (rv < 0)
+        retval = 1;
+    }
+
+    /* Output records still held by latency models */
+    if (retval == 0 && latencymodels && delayflush (ofp))
+      retval = 1;
+
+    if (mergerp)
+      mergerclose (mergerp);
+
+    if (!loop || retval || totalrecsout == 0)
+      break;
+
+    /* Advance record times past the previous pass */
+    span = (loopend - loopstart) / HPTMODULUS * HPTMODULUS + HPTMODULUS;
+    timeshift += span;
+
+    if (verbose)
+      ms_log (1, "Completed pass %d, advancing record times by %lld seconds\n",
+              pass, (long long int)(span / HPTMODULUS));
+  }
+
+  for (recidx = 0; recidx < spillset.runcount; recidx++)
+    fclose (spillset.runs[recidx].fp);
+  spillset.runcount = 0;
+
+  if (closeoutput (ofp))
+    retval = 1;
+
+  return retval;
+} /* End of writerecords() */
+
+/***************************************************************************
+ * nextrecord():
+ *
+ * Return the next Record in output order, either from a RunMerger if
+ * not NULL or from the sorted RecordMap at recidx, which is advanced.
+ *
+ * Returns 0 when a record is returned, 1 when all records have been
+ * returned and -1 on error.
+ ***************************************************************************/
+static int
+nextrecord (RecordMap *recmap, RunMerger *merger, int64_t *recidx, Record *rec)
+{
+  if (merger)
+    return mergernext (merger, rec);
+
+  if (*recidx >= recmap->recordcnt)
+    return 1;
+
+  *rec = recmap->records[(*recidx)++];
+
+  return 0;
+} /* End of nextrecord() */
+
+/***************************************************************************
+ * batchrecords():
+ *
+ * Write all records in output order, reading input in batches of up
+ * to batchsize records.  The records of each batch are ordered by
+ * file and offset and records that are adjacent or separated by less
+ * than BATCHGAP bytes are coalesced into single reads of up to
+ * BATCHMAXREAD bytes.  The records are then written in output order
+ * from memory.  Records of memory mapped files are not read.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+static int
+batchrecords (RecordMap *recmap, RunMerger *merger, OutputFile *ofp)
+{
+  Record *window   = NULL;
+  Record **order   = NULL;
+  char **recptrs   = NULL;
+  BatchRange *ranges = NULL;
+  BatchRange *range;
+  Filelink *flp;
+  char *buffer     = NULL;
+  size_t bufsize   = 0;
+  size_t buflen;
+  int64_t recidx   = 0;
+  ssize_t readcount;
+  off_t end;
+  int rangecount;
+  int count;
+  int ridx;
+  int idx;
+  int rv     = 0;
+  int retval = 0;
+
+  if (!(window = (Record *)malloc (batchsize * sizeof (Record))) ||
+      !(order = (Record **)malloc (batchsize * sizeof (Record *))) ||
+      !(recptrs = (char **)malloc (batchsize * sizeof (char *))) ||
+      !(ranges = (BatchRange *)malloc (batchsize * sizeof (BatchRange))))
+  {
+    ms_log (2, "Cannot allocate memory for read batches\n");
+    retval = -1;
+  }
+
+  while (retval == 0 && rv == 0)
+  {
+    /* Gather the next batch of records in output order */
+    for (count = 0; count < batchsize; count++)
+      if ((rv = nextrecord (recmap, merger, &recidx, &window[count])) != 0)
+        break;
+
+    if (rv < 0)
+    {
+      retval = -1;
+      break;
+    }
+
+    if (count == 0)
+      break;
+
+    /* Order records by file and offset */
+    for (idx = 0; idx < count; idx++)
+    {
+      order[idx]   = &window[idx];
+      recptrs[idx] = NULL;
+    }
+
+    qsort (order, count, sizeof (Record *), batchcmp);
+
+    /* Coalesce nearby records of each file into ranges */
+    for (idx = 0, rangecount = 0, buflen = 0; idx < count; idx++)
+    {
+      flp = REC_FILE (order[idx]);
+      end = REC_OFFSET (order[idx]) + REC_RECLEN (order[idx]);
+
+      if (flp->map)
+        continue;
+
+      range = (rangecount > 0) ? &ranges[rangecount - 1] : NULL;
+
+      if (range && REC_FILE (order[range->first]) == flp &&
+          REC_OFFSET (order[idx]) <= range->start + (off_t)range->length + BATCHGAP &&
+          end - range->start <= BATCHMAXREAD)
+      {
+        if (end > range->start + (off_t)range->length)
+        {
+          buflen += end - (range->start + range->length);
+          range->length = end - range->start;
+        }
+
+        range->last = idx;
+        continue;
+      }
+
+      range         = &ranges[rangecount++];
+      range->first  = idx;
+      range->last   = idx;
+      range->start  = REC_OFFSET (order[idx]);
+      range->length = REC_RECLEN (order[idx]);
+      buflen += range->length;
+    }
+
+    if (buflen > bufsize)
+    {
+      free (buffer);
+
+      if (!(buffer = (char *)malloc (buflen)))
+      {
+        ms_log (2, "Cannot allocate memory for read batches\n");
+        retval = -1;
+        break;
+      }
+
+      bufsize = buflen;
+    }
+
+    /* Read each range and locate its records in the buffer */
+    for (idx = 0, buflen = 0; idx < rangecount && retval == 0; idx++)
+    {
+      range = &ranges[idx];
+      flp   = REC_FILE (order[range->first]);
+
+      /* Open file for reading if not already done */
+      if (!flp->infp && !(flp->infp = fopen (flp->infilename, "rb")))
+      {
+        ms_log (2, "Cannot open '%s' for reading: %s\n",
+                flp->infilename, strerror (errno));
+        retval = -1;
+        break;
+      }
+
+      if ((readcount = pread (fileno (flp->infp), buffer + buflen, range->length, range->start)) !=
+          (ssize_t)range->length)
+      {
+        ms_log (2, "Cannot read %llu bytes at offset %llu from '%s': %s\n",
+                (long long unsigned)range->length, (long long unsigned)range->start,
+                flp->infilename, (readcount < 0) ? strerror (errno) : "short read");
+        retval = -1;
+        break;
+      }
+
+      countread (flp, range->start, range->length);
+
+      for (ridx = range->first; ridx <= range->last; ridx++)
+        recptrs[order[ridx] - window] = buffer + buflen + (REC_OFFSET (order[ridx]) - range->start);
+
+      buflen += range->length;
+    }
+
+    /* Write records in output order */
+    for (idx = 0; idx < count && retval == 0; idx++)
+    {
+      if (writerecord (&window[idx], recptrs[idx], ofp))
+        retval = -1;
+    }
+  }
+
+  free (buffer);
+  free (ranges);
+  free (recptrs);
+  free (order);
+  free (window);
+
+  return retval;
+} /* End of batchrecords() */
+
+/***************************************************************************
+ * batchcmp():
+ *
+ * Compare Record pointers by input file and offset for qsort().
+ ***************************************************************************/
+static int
+batchcmp (const void *a, const void *b)
+{
+  const Record *rec1 = *(const Record **)a;
+  const Record *rec2 = *(const Record **)b;
+
+  if (REC_FILEIDX (rec1) != REC_FILEIDX (rec2))
+    return (REC_FILEIDX (rec1) < REC_FILEIDX (rec2)) ? -1 : 1;
+
+  if (REC_OFFSET (rec1) != REC_OFFSET (rec2))
+    return (REC_OFFSET (rec1) < REC_OFFSET (rec2)) ? -1 : 1;
+
+  return 0;
+} /* End of batchcmp() */
+
+/***************************************************************************
+ * prefetchrecords():
+ *
+ * Write all records in output order while reader threads read
+ * upcoming records into a ring of prefetchslots buffers.  Readers
+ * claim records in output order, wait for the slot of the record to
+ * be released and read the record into the slot buffer.  For memory
+ * mapped files the record is not copied, the pages are touched to
+ * ensure they are resident.
+ *
+ * The calling thread writes records from the slots in order and only
+ * waits for readers if the next record is not ready, which is counted
+ * as a prefetch underrun.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+static int
+prefetchrecords (RecordMap *recmap, RunMerger *merger, OutputFile *ofp)
+{
+  Prefetch prefetch;
+  PrefetchSlot *slot;
+  pthread_t *threads;
+  int nthreads;
+  int started = 0;
+  int waited  = 0;
+  int idx;
+  int retval = 0;
+
+#if HAVE_IOURING
+  /* Use io_uring if available, otherwise fall back to reader threads */
+  if (useiouring && (retval = prefetchuring (recmap, merger, ofp)) <= 0)
+    return retval;
+
+  retval = 0;
+#endif
+
+  memset (&prefetch, 0, sizeof (prefetch));
+  prefetch.recmap    = recmap;
+  prefetch.merger    = merger;
+  prefetch.slotcount = prefetchslots;
+  prefetch.endseq    = -1;
+
+  nthreads = (threadcount < prefetchslots) ? threadcount : prefetchslots;
+
+  if (!(prefetch.slots = (PrefetchSlot *)calloc (prefetchslots, sizeof (PrefetchSlot))) ||
+      !(threads = (pthread_t *)malloc (nthreads * sizeof (pthread_t))))
+  {
+    ms_log (2, "Cannot allocate memory for prefetching\n");
+    free (prefetch.slots);
+    return -1;
+  }
+
+  for (idx = 0; idx < prefetchslots; idx++)
+    prefetch.slots[idx].seq = -1;
+
+  pthread_mutex_init (&prefetch.lock, NULL);
+  pthread_cond_init (&prefetch.ready, NULL);
+  pthread_cond_init (&prefetch.released, NULL);
+
+  if (verbose > 1)
+    ms_log (1, "Prefetching %d records with %d threads\n", prefetchslots, nthreads);
+
+  for (idx = 0; idx < nthreads; idx++)
+  {
+    if (pthread_create (&threads[idx], NULL, prefetchworker, &prefetch))
+    {
+      ms_log (2, "Cannot create prefetching thread: %s\n", strerror (errno));
+      retval = -1;
+      break;
+    }
+
+    started++;
+  }
+
+  pthread_mutex_lock (&prefetch.lock);
+
+  while (retval == 0)
+  {
+    slot = &prefetch.slots[prefetch.sendseq % prefetchslots];
+
+    /* Wait for the next record to be read */
+    if (slot->seq != prefetch.sendseq || slot->state == PREFETCH_READING)
+    {
+      if (prefetch.endseq >= 0 && prefetch.sendseq >= prefetch.endseq)
+        break;
+
+      if (prefetch.error)
+      {
+        retval = -1;
+        break;
+      }
+
+      waited = 1;
+
+      while (!(slot->seq == prefetch.sendseq && slot->state != PREFETCH_READING) &&
+             !(prefetch.endseq >= 0 && prefetch.sendseq >= prefetch.endseq) &&
+             !prefetch.error)
+        pthread_cond_wait (&prefetch.ready, &prefetch.lock);
+
+      continue;
+    }
+
+    /* Count records that were not ready when needed */
+    if (waited)
+    {
+      prefetch.underruns++;
+      waited = 0;
+    }
+
+    pthread_mutex_unlock (&prefetch.lock);
+
+    if (slot->state == PREFETCH_ERROR || writerecord (&slot->rec, slot->recptr, ofp))
+      retval = -1;
+
+    pthread_mutex_lock (&prefetch.lock);
+
+    prefetch.sendseq++;
+    pthread_cond_broadcast (&prefetch.released);
+  }
+
+  /* Stop readers */
+  prefetch.error = 1;
+  pthread_cond_broadcast (&prefetch.released);
+  pthread_mutex_unlock (&prefetch.lock);
+
+  for (idx = 0; idx < started; idx++)
+    pthread_join (threads[idx], NULL);
+
+  if (verbose)
+    ms_log (1, "Prefetch underruns: %lld of %lld records\n",
+            (long long int)prefetch.underruns, (long long int)prefetch.sendseq);
+
+  for (idx = 0; idx < prefetchslots; idx++)
+    free (prefetch.slots[idx].buffer);
+
+  pthread_cond_destroy (&prefetch.released);
+  pthread_cond_destroy (&prefetch.ready);
+  pthread_mutex_destroy (&prefetch.lock);
+  free (prefetch.slots);
+  free (threads);
+
+  return retval;
+} /* End of prefetchrecords() */
+
+/***************************************************************************
+ * prefetchworker():
+ *
+ * Thread routine for reading records ahead of output.  Records are
+ * claimed in output order until all records are claimed or an error
+ * is flagged.
+ ***************************************************************************/
+static void *
+prefetchworker (void *arg)
+{
+  Prefetch *prefetch = (Prefetch *)arg;
+  PrefetchSlot *slot;
+  Filelink *flp;
+  int reclength;
+  int state;
+  int rv;
+
+  pthread_mutex_lock (&prefetch->lock);
+
+  while (!prefetch->error && prefetch->endseq < 0)
+  {
+    /* Wait for the slot of the next record to be released */
+    if (prefetch->nextseq - prefetch->sendseq >= prefetch->slotcount)
+    {
+      pthread_cond_wait (&prefetch->released, &prefetch->lock);
+      continue;
+    }
+
+    slot = &prefetch->slots[prefetch->nextseq % prefetch->slotcount];
+
+    if ((rv = nextrecord (prefetch->recmap, prefetch->merger, &prefetch->recidx, &slot->rec)) != 0)
+    {
+      if (rv < 0)
+        prefetch->error = 1;
+
+      prefetch->endseq = prefetch->nextseq;
+      pthread_cond_broadcast (&prefetch->ready);
+      break;
+    }
+
+    slot->seq   = prefetch->nextseq++;
+    slot->state = PREFETCH_READING;
+
+    flp       = REC_FILE (&slot->rec);
+    reclength = REC_RECLEN (&slot->rec);
+    state     = (prefetchslot (slot, flp, reclength)) ? PREFETCH_ERROR : PREFETCH_READY;
+
+    pthread_mutex_unlock (&prefetch->lock);
+
+    if (state == PREFETCH_READY && prefetchread (slot, flp, reclength))
+      state = PREFETCH_ERROR;
+
+    pthread_mutex_lock (&prefetch->lock);
+
+    if (state == PREFETCH_READY && !flp->map)
+      countread (flp, REC_OFFSET (&slot->rec), reclength);
+
+    slot->state = state;
+    pthread_cond_broadcast (&prefetch->ready);
+  }
+
+  pthread_mutex_unlock (&prefetch->lock);
+
+  return NULL;
+} /* End of prefetchworker() */
+
+/***************************************************************************
+ * prefetchslot():
+ *
+ * Prepare a PrefetchSlot for reading a record of the specified file:
+ * open the file for reading if needed and grow the slot buffer to
+ * the record length.  Nothing is needed for memory mapped files.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+static int
+prefetchslot (PrefetchSlot *slot, Filelink *flp, int reclength)
+{
+  char *buffer;
+
+  if (flp->map)
+    return 0;
+
+  /* Open file for reading if not already done */
+  if (!flp->infp && !(flp->infp = fopen (flp->infilename, "rb")))
+  {
+    ms_log (2, "Cannot open '%s' for reading: %s\n",
+            flp->infilename, strerror (errno));
+    return -1;
+  }
+
+  /* Grow slot buffer as needed */
+  if (slot->bufsize < (size_t)reclength)
+  {
+    if (!(buffer = (char *)realloc (slot->buffer, reclength)))
+    {
+      ms_log (2, "Cannot allocate memory for prefetching\n");
+      return -1;
+    }
+
+    slot->buffer  = buffer;
+    slot->bufsize = reclength;
+  }
+
+  return 0;
+} /* End of prefetchslot() */
+
+#if HAVE_IOURING
+/***************************************************************************
+ * prefetchuring():
+ *
+ * Write all records in output order while keeping up to prefetchslots
+ * record reads in flight using io_uring.  Reads are queued in output
+ * order for free slots, completions may arrive in any order and
+ * records are written in output order as their reads complete.
+ * Records of memory mapped files are not read, the pages are touched
+ * when queued.
+ *
+ * Waiting for the read of the next record to complete is counted as
+ * a prefetch underrun.
+ *
+ * Returns 0 on success, -1 on error and 1 if io_uring is not available.
+ ***************************************************************************/
+static int
+prefetchuring (RecordMap *recmap, RunMerger *merger, OutputFile *ofp)
+{
+  IoRing ring;
+  PrefetchSlot *slots;
+  PrefetchSlot *slot;
+  Filelink *flp;
+  int64_t recidx    = 0;
+  int64_t nextseq   = 0;
+  int64_t sendseq   = 0;
+  int64_t underruns = 0;
+  unsigned inflight = 0;
+  int reclength;
+  int waited = 0;
+  int end    = 0;
+  int idx;
+  int rv;
+  int retval = 0;
+
+  if (ringopen (&ring, prefetchslots))
+  {
+    if (verbose)
+      ms_log (1, "Cannot use io_uring (%s), using reader threads\n", strerror (errno));
+    return 1;
+  }
+
+  if (!(slots = (PrefetchSlot *)calloc (prefetchslots, sizeof (PrefetchSlot))))
+  {
+    ms_log (2, "Cannot allocate memory for prefetching\n");
+    ringclose (&ring);
+    return -1;
+  }
+
+  if (verbose > 1)
+    ms_log (1, "Prefetching %d records with io_uring\n", prefetchslots);
+
+  while (retval == 0)
+  {
+    /* Queue reads of upcoming records into free slots */
+    while (!end && nextseq - sendseq < prefetchslots)
+    {
+      slot = &slots[nextseq % prefetchslots];
+
+      if ((rv = nextrecord (recmap, merger, &recidx, &slot->rec)) != 0)
+      {
+        if (rv < 0)
+          retval = -1;
+        end = 1;
+        break;
+      }
+
+      slot->seq = nextseq++;
+      flp       = REC_FILE (&slot->rec);
+      reclength = REC_RECLEN (&slot->rec);
+
+      if (prefetchslot (slot, flp, reclength))
+      {
+        slot->state = PREFETCH_ERROR;
+      }
+      else if (flp->map)
+      {
+        slot->state = (prefetchread (slot, flp, reclength)) ? PREFETCH_ERROR : PREFETCH_READY;
+      }
+      else
+      {
+        slot->state        = PREFETCH_READING;
+        slot->recptr       = slot->buffer;
+        slot->iov.iov_base = slot->buffer;
+        slot->iov.iov_len  = reclength;
+        ringread (&ring, fileno (flp->infp), &slot->iov, REC_OFFSET (&slot->rec),
+                  (uint64_t) (slot - slots));
+        inflight++;
+      }
+    }
+
+    if (retval || sendseq >= nextseq)
+      break;
+
+    slot = &slots[sendseq % prefetchslots];
+
+    if (slot->state == PREFETCH_READING)
+      waited = 1;
+
+    /* Submit queued reads and process completions, waiting for the
+     * next record if not yet read */
+    while (ring.pending > 0 || slot->state == PREFETCH_READING)
+    {
+      if (ringenter (&ring, (slot->state == PREFETCH_READING) ? 1 : 0))
+      {
+        ms_log (2, "Cannot submit reads to io_uring: %s\n", strerror (errno));
+        retval = -1;
+        break;
+      }
+
+      /* Process all completions */
+      while (*ring.cqhead != __atomic_load_n (ring.cqtail, __ATOMIC_ACQUIRE))
+      {
+        struct io_uring_cqe *cqe = &ring.cqes[*ring.cqhead & ring.cqmask];
+        PrefetchSlot *done       = &slots[cqe->user_data];
+
+        flp       = REC_FILE (&done->rec);
+        reclength = REC_RECLEN (&done->rec);
+
+        if (cqe->res != reclength)
+        {
+          ms_log (2, "Cannot read %d bytes at offset %llu from '%s': %s\n",
+                  reclength, (long long unsigned)REC_OFFSET (&done->rec), flp->infilename,
+                  (cqe->res < 0) ? strerror (-cqe->res) : "short read");
+          done->state = PREFETCH_ERROR;
+        }
+        else
+        {
+          countread (flp, REC_OFFSET (&done->rec), reclength);
+          done->state = PREFETCH_READY;
+        }
+
+        inflight--;
+        __atomic_store_n (ring.cqhead, *ring.cqhead + 1, __ATOMIC_RELEASE);
+      }
+    }
+
+    if (retval)
+      break;
+
+    if (waited)
+    {
+      underruns++;
+      waited = 0;
+    }
+
+    if (slot->state == PREFETCH_ERROR || writerecord (&slot->rec, slot->recptr, ofp))
+      retval = -1;
+
+    sendseq++;
+  }
+
+  /* Wait for reads in flight before releasing buffers */
+  while (inflight > 0 && ringenter (&ring, inflight) == 0)
+  {
+    while (*ring.cqhead != __atomic_load_n (ring.cqtail, __ATOMIC_ACQUIRE))
+    {
+      inflight--;
+      __atomic_store_n (ring.cqhead, *ring.cqhead + 1, __ATOMIC_RELEASE);
+    }
+  }
+
+  if (verbose)
+    ms_log (1, "Prefetch underruns: %lld of %lld records\n",
+            (long long int)underruns, (long long int)sendseq);
+
+  ringclose (&ring);
+
+  for (idx = 0; idx < prefetchslots; idx++)
+    free (slots[idx].buffer);
+  free (slots);
+
+  return retval;
+} /* End of prefetchuring() */
+
+/***************************************************************************
+ * ringopen():
+ *
+ * Create an io_uring instance with at least the specified number of
+ * entries and map its submission and completion queues.
+ *
+ * Returns 0 on success and -1 on error with errno set.
+ ***************************************************************************/
+static int
+ringopen (IoRing *ring, unsigned entries)
+{
+  struct io_uring_params params;
+  char *sqmap;
+  char *cqmap;
+
+  memset (ring, 0, sizeof (IoRing));
+  memset (&params, 0, sizeof (params));
+
+  if ((ring->fd = (int)syscall (__NR_io_uring_setup, entries, &params)) < 0)
+    return -1;
+
+  ring->sqmapsize = params.sq_off.array + params.sq_entries * sizeof (unsigned);
+  ring->cqmapsize = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+  ring->sqesize   = params.sq_entries * sizeof (struct io_uring_sqe);
+
+  /* Both queue rings are in a single mapping with IORING_FEAT_SINGLE_MMAP */
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+  {
+    if (ring->cqmapsize > ring->sqmapsize)
+      ring->sqmapsize = ring->cqmapsize;
+    ring->cqmapsize = 0;
+  }
+
+  ring->sqmap = mmap (NULL, ring->sqmapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sqmap == MAP_FAILED)
+  {
+    ring->sqmap = NULL;
+    ringclose (ring);
+    return -1;
+  }
+
+  if (ring->cqmapsize)
+  {
+    ring->cqmap = mmap (NULL, ring->cqmapsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cqmap == MAP_FAILED)
+    {
+      ring->cqmap = NULL;
+      ringclose (ring);
+      return -1;
+    }
+  }
+
+  ring->sqes = (struct io_uring_sqe *)mmap (NULL, ring->sqesize, PROT_READ | PROT_WRITE,
+                                            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED)
+  {
+    ring->sqes = NULL;
+    ringclose (ring);
+    return -1;
+  }
+
+  sqmap = (char *)ring->sqmap;
+  cqmap = (ring->cqmap) ? (char *)ring->cqmap : sqmap;
+
+  ring->sqhead  = (unsigned *)(sqmap + params.sq_off.head);
+  ring->sqtail  = (unsigned *)(sqmap + params.sq_off.tail);
+  ring->sqmask  = *(unsigned *)(sqmap + params.sq_off.ring_mask);
+  ring->sqarray = (unsigned *)(sqmap + params.sq_off.array);
+  ring->cqhead  = (unsigned *)(cqmap + params.cq_off.head);
+  ring->cqtail  = (unsigned *)(cqmap + params.cq_off.tail);
+  ring->cqmask  = *(unsigned *)(cqmap + params.cq_off.ring_mask);
+  ring->cqes    = (struct io_uring_cqe *)(cqmap + params.cq_off.cqes);
+
+  return 0;
+} /* End of ringopen() */
+
+/***************************************************************************
+ * ringread():
+ *
+ * Queue a read into an iovec at the specified file offset, submitted
+ * with the next call to ringenter().  The caller must ensure no more
+ * entries are queued and in flight than the ring was opened with.
+ ***************************************************************************/
+static void
+ringread (IoRing *ring, int fd, struct iovec *iov, off_t offset, uint64_t userdata)
+{
+  struct io_uring_sqe *sqe;
+  unsigned tail  = *ring->sqtail;
+  unsigned index = tail & ring->sqmask;
+
+  sqe = &ring->sqes[index];
+  memset (sqe, 0, sizeof (struct io_uring_sqe));
+  sqe->opcode    = IORING_OP_READV;
+  sqe->fd        = fd;
+  sqe->addr      = (uint64_t) (uintptr_t)iov;
+  sqe->len       = 1;
+  sqe->off       = (uint64_t)offset;
+  sqe->user_data = userdata;
+
+  ring->sqarray[index] = index;
+  __atomic_store_n (ring->sqtail, tail + 1, __ATOMIC_RELEASE);
+
+  ring->pending++;
+} /* End of ringread() */
+
+/***************************************************************************
+ * ringenter():
+ *
+ * Submit all queued entries and wait for at least waitcount
+ * completions.
+ *
+ * Returns 0 on success and -1 on error with errno set.
+ ***************************************************************************/
+static int
+ringenter (IoRing *ring, unsigned waitcount)
+{
+  int rv;
+
+  do
+  {
+    rv = (int)syscall (__NR_io_uring_enter, ring->fd, ring->pending, waitcount,
+                       (waitcount) ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (rv < 0 && errno == EINTR);
+
+  if (rv < 0)
+    return -1;
+
+  ring->pending -= (unsigned)rv;
+
+  return 0;
+} /* End of ringenter() */
+
+/***************************************************************************
+ * ringclose():
+ *
+ * Unmap the queues and close an io_uring instance.
+ ***************************************************************************/
+static void
+ringclose (IoRing *ring)
+{
+  if (ring->sqes)
+    munmap (ring->sqes, ring->sqesize);
+  if (ring->cqmap)
+    munmap (ring->cqmap, ring->cqmapsize);
+  if (ring->sqmap)
+    munmap (ring->sqmap, ring->sqmapsize);
+  if (ring->fd >= 0)
+    close (ring->fd);
+
+  ring->fd = -1;
+} /* End of ringclose() */
+#endif /* HAVE_IOURING */
+
+/***************************************************************************
+ * prefetchread():
+ *
+ * Read the record of a PrefetchSlot into the slot buffer, or for
+ * memory mapped files touch each page of the record in the mapping.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+static int
+prefetchread (PrefetchSlot *slot, Filelink *flp, int reclength)
+{
+  volatile char touch;
+  off_t offset = REC_OFFSET (&slot->rec);
+  ssize_t readcount;
+  int idx;
+
+  if (flp->map)
+  {
+    if ((size_t)offset + reclength > flp->mapsize)
+    {
+      ms_log (2, "Record at offset %llu extends beyond end of '%s'\n",
+              (long long unsigned)offset, flp->infilename);
+      return -1;
+    }
+
+    slot->recptr = flp->map + offset;
+
+    for (idx = 0; idx < reclength; idx += 4096)
+      touch = slot->recptr[idx];
+    (void)touch;
+
+    return 0;
+  }
+
+  if ((readcount = pread (fileno (flp->infp), slot->buffer, reclength, offset)) != reclength)
+  {
+    ms_log (2, "Cannot read %d bytes at offset %llu from '%s': %s\n",
+            reclength, (long long unsigned)offset, flp->infilename,
+            (readcount < 0) ? strerror (errno) : "short read");
+    return -1;
+  }
+
+  slot->recptr = slot->buffer;
+
+  return 0;
+} /* End of prefetchread() */
+
+/***************************************************************************
+ * streamrecords():
+ *
+ * Read all input files concurrently and write records to output in
+ * time order without building and sorting a complete record index.
+ *
+ * Each input file is treated as a time ordered run of records and
+ * the runs are merged using a min-heap keyed on record end time,
+ * ties are ordered by input file and offset to match the order of a
+ * full sort.  Up to streamwindow selected records of each file are
+ * held in the heap, which reorders records that are out of order by
+ * less than the window, e.g. the channels of a multiplexed file.
+ * Memory use is independent of the amount of input data.
+ *
+ * Records that would be written before a record with a later end
+ * time, i.e. out of time order, are counted and reported.
+ *
+ * Returns 0 on success and 1 on error.
+ ***************************************************************************/
+static int
+streamrecords (void)
+{
+  StreamFile *files = NULL;
+  StreamFile *sfp;
+  MergeHeap heap;
+  Record rec;
+  uint32_t source;
+  OutputFile *ofp          = NULL;
+  hptime_t lastendtime     = HPTERROR;
+  int64_t totalrecs        = 0;
+  int64_t totalsamps       = 0;
+  int64_t outoforder       = 0;
+  hptime_t streamstart     = gethptime ();
+  uint32_t fileidx;
+  int retval = 0;
+
+  memset (&heap, 0, sizeof (heap));
+
+  if (!(files = (StreamFile *)calloc (filecount, sizeof (StreamFile))) ||
+      !(heap.nodes = (MergeNode *)malloc ((size_t)filecount * streamwindow * sizeof (MergeNode))))
+  {
+    ms_log (2, "Cannot allocate memory for stream merge\n");
+    free (files);
+    return 1;
+  }
+
+  /* Each file needs a stream for reading and may need another for output */
+  setofilelimit (2 * filecount + 20);
+
+  if (openoutput (&ofp))
+    retval = 1;
+
+  /* Open all input files and fill the heap with initial records */
+  for (fileidx = 0; fileidx < filecount && !retval; fileidx++)
+  {
+    sfp = &files[fileidx];
+
+    if (usemmap && mapfile (fileindex[fileidx]))
+      retval = 1;
+    else if (cursoropen (&sfp->cursor, fileindex[fileidx], STREAMBUFSIZE))
+      retval = 1;
+    else if (streamfill (sfp, fileidx, &heap, &totalsamps))
+      retval = 1;
+  }
+
+  if (!retval && verbose > 1)
+    ms_log (1, "Merging %u input files, first record after %.3f seconds\n", filecount,
+            (double)(gethptime () - streamstart) / HPTMODULUS);
+
+  /* Write the earliest record and replace it with the next from the same file */
+  while (!retval && heappop (&heap, &rec, &source) == 0)
+  {
+    sfp = &files[source];
+    sfp->pending--;
+
+    if (lastendtime != HPTERROR && rec.endtime < lastendtime)
+    {
+      if (outoforder == 0 || verbose > 1)
+      {
+        char timestr[30];
+        ms_hptime2seedtimestr (rec.endtime, timestr, 1);
+        ms_log (1, "Warning: record ending %s at offset %lld of %s is out of time order\n",
+                timestr, (long long int)REC_OFFSET (&rec), sfp->cursor.flp->infilename);
+      }
+
+      outoforder++;
+    }
+    else
+    {
+      lastendtime = rec.endtime;
+    }
+
+    if (writerecord (&rec, streamrecptr (sfp, &rec), ofp))
+      retval = 1;
+    else if (streamfill (sfp, source, &heap, &totalsamps))
+      retval = 1;
+
+    totalrecs++;
+  }
+
+  for (fileidx = 0; fileidx < filecount; fileidx++)
+    cursorclose (&files[fileidx].cursor);
+
+  if (retval == 0 && latencymodels && delayflush (ofp))
+    retval = 1;
+
+  if (closeoutput (ofp))
+    retval = 1;
+
+  if (outoforder)
+    ms_log (1, "Warning: %lld records written out of time order, increase -streamwin "
+               "or use the default sorted mode\n", (long long int)outoforder);
+
+  if (basicsum)
+  {
+    ms_log (0, "Files: %d, Records: %lld, Samples: %lld\n", filecount,
+            (long long int)totalrecs, (long long int)totalsamps);
+    ms_log (0, "Record merge heap: %llu bytes, %d records per file\n",
+            (long long unsigned int)((size_t)filecount * streamwindow * sizeof (MergeNode)),
+            streamwindow);
+  }
+
+  free (heap.nodes);
+  free (files);
+
+  return retval;
+} /* End of streamrecords() */
+
+/***************************************************************************
+ * streamfill():
+ *
+ * Read records from an input file and add those matching the
+ * selection criteria to the merge heap until streamwindow records of
+ * the file are in the heap or the end of the file is reached.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+static int
+streamfill (StreamFile *sfp, uint32_t fileidx, MergeHeap *heap, int64_t *samplecnt)
+{
+  RecordHeader hdr;
+  Record rec;
+  const char *skip;
+  off_t offset;
+  int recordlen;
+  int rv;
+
+  while (!sfp->done && sfp->pending < streamwindow)
+  {
+    if ((rv = cursornext (&sfp->cursor, &hdr, &offset, &recordlen, NULL)) != 0)
+    {
+      if (rv == 2)
+        ms_log (2, "Packed files are not supported in streaming mode: %s\n",
+                sfp->cursor.flp->infilename);
+
+      if (rv == 1 && verbose > 1)
+        ms_log (1, "Finished reading %s\n", sfp->cursor.flp->infilename);
+
+      sfp->done = 1;
+
+      if (rv != 1)
+        return -1;
+
+      break;
+    }
+
+    if (verbose > 2)
+    {
+      char stime[30];
+      ms_hptime2seedtimestr (hdr.starttime, stime, 1);
+      ms_log (1, "%s, %d bytes, %lld samples, %s\n", hdr.srcname, recordlen,
+              (long long int)hdr.samplecnt, stime);
+    }
+
+    if (!(skip = timeskip (hdr.starttime, hdr.endtime)))
+      skip = sourceskip (hdr.srcname);
+
+    if (skip)
+    {
+      if (verbose >= 3)
+      {
+        char stime[30];
+        ms_hptime2seedtimestr (hdr.starttime, stime, 1);
+        ms_log (1, "Skipping (%s) %s, %s\n", skip, hdr.srcname, stime);
+      }
+      continue;
+    }
+
+    rec.starttime = hdr.starttime;
+    rec.endtime   = hdr.endtime;
+
+    if (packrecord (&rec, fileidx, offset, recordlen))
+    {
+      ms_log (2, "Cannot index record of %d bytes at offset %lld in %s\n",
+              recordlen, (long long int)offset, sfp->cursor.flp->infilename);
+      return -1;
+    }
+
+    heappush (heap, &rec, fileidx);
+    sfp->pending++;
+    *samplecnt += hdr.samplecnt;
+  }
+
+  return 0;
+} /* End of streamfill() */
+
+/***************************************************************************
+ * streamrecptr():
+ *
+ * Return a pointer to a record if it is still contained in the read
+ * buffer of the file, otherwise NULL.
+ ***************************************************************************/
+static char *
+streamrecptr (StreamFile *sfp, Record *rec)
+{
+  RecordCursor *cursor = &sfp->cursor;
+  off_t offset         = REC_OFFSET (rec);
+
+  if (!cursor->fp || offset < cursor->bufstart ||
+      offset + REC_RECLEN (rec) > cursor->bufstart + (off_t)cursor->buflen)
+    return NULL;
+
+  return cursor->buffer + (offset - cursor->bufstart);
+} /* End of streamrecptr() */
+
+/***************************************************************************
+ * heappush():
+ *
+ * Add a Record read from the specified source to a MergeHeap, the
+ * caller must ensure space is available.
+ ***************************************************************************/
+static void
+heappush (MergeHeap *heap, Record *rec, uint32_t source)
+{
+  size_t idx = heap->count++;
+  size_t parent;
+
+  while (idx > 0)
+  {
+    parent = (idx - 1) / 2;
+
+    if (mergecmp (&heap->nodes[parent].rec, rec) <= 0)
+      break;
+
+    heap->nodes[idx] = heap->nodes[parent];
+    idx              = parent;
+  }
+
+  heap->nodes[idx].rec    = *rec;
+  heap->nodes[idx].source = source;
+} /* End of heappush() */
+
+/***************************************************************************
+ * heappop():
+ *
+ * Remove the earliest Record, and the source it was read from, from
+ * a MergeHeap.
+ *
+ * Returns 0 on success and -1 if the heap is empty.
+ ***************************************************************************/
+static int
+heappop (MergeHeap *heap, Record *rec, uint32_t *source)
+{
+  MergeNode *last;
+  size_t idx = 0;
+  size_t child;
+
+  if (heap->count == 0)
+    return -1;
+
+  *rec    = heap->nodes[0].rec;
+  *source = heap->nodes[0].source;
+  last    = &heap->nodes[--heap->count];
+
+  while ((child = 2 * idx + 1) < heap->count)
+  {
+    if (child + 1 < heap->count &&
+        mergecmp (&heap->nodes[child + 1].rec, &heap->nodes[child].rec) < 0)
+      child++;
+
+    if (mergecmp (&last->rec, &heap->nodes[child].rec) <= 0)
+      break;
+
+    heap->nodes[idx] = heap->nodes[child];
+    idx              = child;
+  }
+
+  heap->nodes[idx] = *last;
+
+  return 0;
+} /* End of heappop() */
+
+/***************************************************************************
+ * mergecmp():
+ *
+ * Compare Records by end time, input file and file offset.
+ *
+ * Return -1, 0 or 1 if rec1 is less than, equal to or greater than rec2.
+ ***************************************************************************/
+static int
+mergecmp (Record *rec1, Record *rec2)
+{
+  if (rec1->endtime != rec2->endtime)
+    return (rec1->endtime < rec2->endtime) ? -1 : 1;
+
+  if (REC_FILEIDX (rec1) != REC_FILEIDX (rec2))
+    return (REC_FILEIDX (rec1) < REC_FILEIDX (rec2)) ? -1 : 1;
+
+  if (REC_OFFSET (rec1) != REC_OFFSET (rec2))
+    return (REC_OFFSET (rec1) < REC_OFFSET (rec2)) ? -1 : 1;
+
+  return 0;
+} /* End of mergecmp() */
+
+/***************************************************************************
+ * openoutput():
+ *
+ * Open the output files, if specified, as a list and report the output
+ * targets.
+ *
+ * If only writing unmodified records to output files that are all
+ * regular files or all pipes a zero-copy output method is selected.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+static int
+openoutput (OutputFile **ofp)
+{
+  OutputFile *of    = NULL;
+  OutputFile **tail = ofp;
+  struct stat sbuf;
+  int method;
+  int idx;
+
+  *ofp = NULL;
+
+  /* Open the output files if specified */
+  for (idx = 0; idx < outputcount; idx++)
+  {
+    if (verbose)
+      ms_log (1, "Writing output data to %s\n", outputfiles[idx]);
+
+    if (!(of = (OutputFile *)calloc (1, sizeof (OutputFile))))
+    {
+      ms_log (2, "Cannot allocate memory for output file\n");
+      return -1;
+    }
+
+    of->filename = outputfiles[idx];
+
+    /* Buffer size is a multiple of the alignment needed for O_DIRECT */
+    of->bufsize = (outbufsize + OUTALIGN - 1) / OUTALIGN * OUTALIGN;
+
+    if (posix_memalign ((void **)&of->buffer, OUTALIGN, of->bufsize) ||
+        !(of->iov = (struct iovec *)malloc (OUTIOVMAX * sizeof (struct iovec))))
+    {
+      ms_log (2, "Cannot allocate memory for output buffer\n");
+      free (of->buffer);
+      free (of);
+      return -1;
+    }
+
+    if (strcmp (of->filename, "-") == 0)
+    {
+      of->fd = STDOUT_FILENO;
+    }
+    else if ((of->fd = open (of->filename, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+    {
+      ms_log (2, "Cannot open output file: %s (%s)\n",
+              of->filename, strerror (errno));
+      free (of->iov);
+      free (of->buffer);
+      free (of);
+      return -1;
+    }
+
+    if (outdirect)
+    {
+#ifdef O_DIRECT
+      if (fcntl (of->fd, F_SETFL, fcntl (of->fd, F_GETFL) | O_DIRECT) == 0)
+        of->direct = 1;
+      else
+#endif
+        ms_log (1, "Warning: direct output not supported for %s, using buffered output\n",
+                of->filename);
+    }
+
+    of->opentime = gethptime ();
+    *tail        = of;
+    tail         = &of->next;
+  }
+
+  for (idx = 0; idx < dlcount; idx++)
+  {
+    if (verbose)
+      ms_log (1, "Sending output data to %s over %d connection%s\n",
+              senders[idx * dlconns].dlconn->addr, dlconns, (dlconns > 1) ? "s" : "");
+  }
+
+  /* Copy records directly from input to output files when the record
+   * contents are not otherwise needed and all files support the same
+   * method */
+  outputcopy = OUTCOPY_NONE;
+
+  if (*ofp && !senders && !retime && !loop && !latencymodels && verbose <= 1)
+  {
+    for (of = *ofp; of; of = of->next)
+    {
+      method = OUTCOPY_NONE;
+
+      if (!of->direct && !fstat (of->fd, &sbuf))
+      {
+#if HAVE_COPY_FILE_RANGE
+        if (S_ISREG (sbuf.st_mode))
+          method = OUTCOPY_RANGE;
+#endif
+#if HAVE_SPLICE
+        if (S_ISFIFO (sbuf.st_mode))
+          method = OUTCOPY_SPLICE;
+#endif
+      }
+
+      if (method == OUTCOPY_NONE || (of != *ofp && method != outputcopy))
+      {
+        outputcopy = OUTCOPY_NONE;
+        break;
+      }
+
+      outputcopy = method;
+    }
+  }
+
+  return 0;
+} /* End of openoutput() */
+
+/***************************************************************************
+ * closeoutput():
+ *
+ * Flush and close the output files, close all open input files and
+ * report output totals.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+static int
+closeoutput (OutputFile *ofp)
+{
+  Filelink *flp;
+  OutputFile *of;
+  DLSender *sp;
+  AckWindow acktotal;
+  double elapsed;
+  int retval = 0;
+  int idx;
+
+  /* Buffered output may reference memory mapped input */
+  for (of = ofp; of; of = of->next)
+    if (outputflush (of, 1))
+      retval = -1;
+
+  /* Send queued DataLink records and wait for acknowledgements */
+  if (senders)
+    stopsenders ();
+
+  /* Close all open input files */
+  flp = filelist;
+  while (flp)
+  {
+    if (flp->infp)
+    {
+      fclose (flp->infp);
+      flp->infp = 0;
+    }
+
+    flp = flp->next;
+  }
+
+  unmapfiles ();
+
+  if (verbose)
+  {
+    ms_log (1, "Wrote %llu bytes of %llu records to output\n",
+            (long long unsigned int)totalbytesout, (long long unsigned int)totalrecsout);
+
+    if (totalreads > 0)
+      ms_log (1, "Read %llu bytes of input in %llu reads with %llu seeks, %.0f bytes/read\n",
+              (long long unsigned int)totalbytesread, (long long unsigned int)totalreads,
+              (long long unsigned int)totalseeks, (double)totalbytesread / totalreads);
+
+    if (pacestats.count > 0)
+      ms_log (1, "Paced %llu records, behind schedule p50 %.1f us, p99 %.1f us, max %.1f us\n",
+              (long long unsigned int)pacestats.count, latepercentile (0.50) / 1000.0,
+              latepercentile (0.99) / 1000.0, pacestats.max / 1000.0);
+
+    if (ratebucket.reports > 0)
+      ms_log (1, "Target rate deviation over %llu intervals, mean %.2f%%, max %.2f%%\n",
+              (long long unsigned int)ratebucket.reports,
+              ratebucket.devsum / ratebucket.reports, ratebucket.devmax);
+
+    if (delayqueue.delayed > 0)
+      ms_log (1, "Delayed %llu records by latency models, mean %.3f s, max %.3f s, "
+                 "up to %d records held\n",
+              (long long unsigned int)delayqueue.delayed,
+              delayqueue.delaysum / delayqueue.delayed,
+              (double)delayqueue.delaymax / HPTMODULUS, delayqueue.maxcount);
+
+    if (totalcopied > 0)
+      ms_log (1, "Copied %llu bytes directly from input to output with %s\n",
+              (long long unsigned int)totalcopied,
+              (outputcopy == OUTCOPY_SPLICE) ? "splice()" : "copy_file_range()");
+
+    memset (&acktotal, 0, sizeof (acktotal));
+
+    for (idx = 0; idx < sendercount; idx++)
+    {
+      sp      = &senders[idx];
+      elapsed = (double)(sp->endtime - sp->starttime) / HPTMODULUS;
+
+      ms_log (1, "DataLink connection %d to %s sent %llu bytes of %llu records, %.0f bytes/s\n",
+              idx % dlconns + 1, sp->dlconn->addr, (long long unsigned int)sp->bytes,
+              (long long unsigned int)sp->records, (elapsed > 0.0) ? sp->bytes / elapsed : 0.0);
+
+      if (sp->dropped > 0)
+        ms_log (1, "DataLink connection %d to %s dropped %llu records%s\n",
+                idx % dlconns + 1, sp->dlconn->addr, (long long unsigned int)sp->dropped,
+                (sp->closed) ? " and was closed" : "");
+
+      acktotal.acked += sp->ackwin.acked;
+      acktotal.rejected += sp->ackwin.rejected;
+      acktotal.resent += sp->ackwin.resent;
+    }
+
+    if (senders && ackwindow > 0)
+      ms_log (1, "DataLink server acknowledged %llu records, rejected %llu, %llu retransmitted\n",
+              (long long unsigned int)acktotal.acked, (long long unsigned int)acktotal.rejected,
+              (long long unsigned int)acktotal.resent);
+
+    for (of = ofp; of; of = of->next)
+    {
+      if (of->writes == 0)
+        continue;
+
+      elapsed = (double)(gethptime () - of->opentime) / HPTMODULUS;
+
+      ms_log (1, "Output %llu bytes to %s in %llu writes%s, %.3f writes/record, %.0f bytes/s\n",
+              (long long unsigned int)of->written, of->filename, (long long unsigned int)of->writes,
+              (of->direct) ? " with O_DIRECT" : "",
+              (totalrecsout) ? (double)of->writes / totalrecsout : 0.0,
+              (elapsed > 0.0) ? of->written / elapsed : 0.0);
+    }
+  }
+
+  /* Close output files */
+  while (ofp)
+  {
+    of  = ofp;
+    ofp = ofp->next;
+
+    if (of->fd != STDOUT_FILENO && close (of->fd))
+    {
+      ms_log (2, "Cannot close output file %s: %s\n", of->filename, strerror (errno));
+      retval = -1;
+    }
+
+    free (of->iov);
+    free (of->buffer);
+    free (of);
+  }
+
+  return retval;
+} /* End of closeoutput() */
+
+/***************************************************************************
+ * outputwrite():
+ *
+ * Add data to the output file buffer, flushing when the flush size is
+ * reached.  If mapped is true the data is within a memory mapped input
+ * file and is referenced in place unless writing with O_DIRECT, other
+ * data is copied to the aligned output buffer.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+static int
+outputwrite (OutputFile *ofp, char *ptr, size_t length, flag mapped)
+{
+  struct iovec *last;
+  size_t count;
+
+  if (ofp->direct)
+    mapped = 0;
+
+  while (length > 0)
+  {
+    if (ofp->iovcnt >= OUTIOVMAX || (!mapped && ofp->buflen >= ofp->bufsize))
+      if (outputflush (ofp, 0))
+        return -1;
+
+    last = (ofp->iovcnt > 0) ? &ofp->iov[ofp->iovcnt - 1] : NULL;
+
+    /* Reference mapped data, extending the last vector if contiguous */
+    if (mapped)
+    {
+      count = length;
+
+      if (last && (char *)last->iov_base + last->iov_len == ptr)
+        last->iov_len += count;
+      else
+      {
+        ofp->iov[ofp->iovcnt].iov_base = ptr;
+        ofp->iov[ofp->iovcnt].iov_len  = count;
+        ofp->iovcnt++;
+      }
+    }
+    /* Copy to output buffer, extending the last vector if contiguous */
+    else
+    {
+      count = ofp->bufsize - ofp->buflen;
+      if (count > length)
+        count = length;
+
+      memcpy (ofp->buffer + ofp->buflen, ptr, count);
+
+      if (last && (char *)last->iov_base + last->iov_len == ofp->buffer + ofp->buflen)
+        last->iov_len += count;
+      else
+      {
+        ofp->iov[ofp->iovcnt].iov_base = ofp->buffer + ofp->buflen;
+        ofp->iov[ofp->iovcnt].iov_len  = count;
+        ofp->iovcnt++;
+      }
+
+      ofp->buflen += count;
+    }
+
+    ofp->pending += count;
+    ptr += count;
+    length -= count;
+  }
+
+  if (ofp->pending >= ofp->bufsize)
+    return outputflush (ofp, 0);
+
+  return 0;
+} /* End of outputwrite() */
+
+/***************************************************************************
+ * outputflush():
+ *
+ * Write pending output with writev().  With O_DIRECT only whole blocks
+ * are written and the remainder is kept in the buffer, unless this is
+ * the final flush in which case O_DIRECT is cleared to write the tail.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+static int
+outputflush (OutputFile *ofp, flag final)
+{
+  struct iovec *iov = ofp->iov;
+  size_t remainder  = 0;
+  ssize_t written;
+  int iovcnt = ofp->iovcnt;
+
+  if (!ofp->pending)
+    return 0;
+
+  /* With O_DIRECT all output is in a single contiguous buffer vector */
+  if (ofp->direct)
+  {
+    remainder = ofp->buflen % OUTALIGN;
+
+    if (final && remainder)
+    {
+#ifdef O_DIRECT
+      fcntl (ofp->fd, F_SETFL, fcntl (ofp->fd, F_GETFL) & ~O_DIRECT);
+#endif
+      remainder = 0;
+    }
+
+    if (ofp->buflen == remainder)
+      return 0;
+
+    iov->iov_len = ofp->buflen - remainder;
+  }
+
+  while (iovcnt > 0)
+  {
+    if ((written = writev (ofp->fd, iov, iovcnt)) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+
+      ms_log (2, "Cannot write to '%s': %s\n", ofp->filename, strerror (errno));
+      return -1;
+    }
+
+    ofp->writes++;
+    ofp->written += written;
+
+    /* Skip completely written vectors and advance into a partial one */
+    while (iovcnt > 0 && (size_t)written >= iov->iov_len)
+    {
+      written -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+
+    if (iovcnt > 0)
+    {
+      iov->iov_base = (char *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+
+  ofp->iovcnt  = 0;
+  ofp->pending = 0;
+
+  /* Keep any partial block for the next O_DIRECT write */
+  if (remainder)
+  {
+    memmove (ofp->buffer, ofp->buffer + ofp->buflen - remainder, remainder);
+
+    ofp->iov[0].iov_base = ofp->buffer;
+    ofp->iov[0].iov_len  = remainder;
+    ofp->iovcnt          = 1;
+    ofp->pending         = remainder;
+  }
+
+  ofp->buflen = remainder;
+
+  return 0;
+} /* End of outputflush() */
+
+/***************************************************************************
+ * countread():
+ *
+ * Count a read of input data for output statistics.  A read that does
+ * not start where the previous read ended is counted as a seek.
+ *
+ * Must not be called concurrently.
+ ***************************************************************************/
+static void
+countread (Filelink *flp, off_t offset, size_t length)
+{
+  static Filelink *lastflp = NULL;
+  static off_t lastend     = 0;
+
+  if (flp != lastflp || offset != lastend)
+    totalseeks++;
+
+  totalreads++;
+  totalbytesread += length;
+
+  lastflp = flp;
+  lastend = offset + length;
+} /* End of countread() */
+
+/***************************************************************************
+ * copyrange():
+ *
+ * Copy a range of an input file to the output file without reading it
+ * into memory, using copy_file_range() for regular files and splice()
+ * for pipes.  If the method is not supported by the files involved the
+ * remainder is copied through the record buffer and zero-copy output is
+ * disabled for following records, which are then buffered.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+static int
+copyrange (Filelink *flp, off_t offset, size_t length, OutputFile *ofp)
+{
+#if HAVE_SPLICE
+  loff_t inoffset = offset;
+#else
+  off_t inoffset = offset;
+#endif
+  size_t remaining = length;
+  ssize_t copied   = -1;
+  int outfd = ofp->fd;
+  int infd;
+
+  /* Open file for reading if not already done */
+  if (!flp->infp)
+    if (!(flp->infp = fopen (flp->infilename, "rb")))
+    {
+      ms_log (2, "Cannot open '%s' for reading: %s\n",
+              flp->infilename, strerror (errno));
+      return -1;
+    }
+
+  infd = fileno (flp->infp);
+
+  /* Output written directly to the file descriptor must follow any
+   * buffered records */
+  if (outputflush (ofp, 0))
+    return -1;
+
+  while (remaining > 0 && outputcopy != OUTCOPY_NONE)
+  {
+#if HAVE_COPY_FILE_RANGE
+    if (outputcopy == OUTCOPY_RANGE)
+      copied = copy_file_range (infd, &inoffset, outfd, NULL, remaining, 0);
+#endif
+#if HAVE_SPLICE
+    if (outputcopy == OUTCOPY_SPLICE)
+      copied = splice (infd, &inoffset, outfd, NULL, remaining, SPLICE_F_MOVE);
+#endif
+
+    if (copied >= 0)
+      ofp->writes++;
+
+    if (copied > 0)
+    {
+      remaining -= copied;
+      totalcopied += copied;
+      ofp->written += copied;
+    }
+    else if (copied == 0)
+    {
+      ms_log (2, "Cannot read %llu bytes at offset %llu from '%s'\n",
+              (long long unsigned)length, (long long unsigned)offset, flp->infilename);
+      return -1;
+    }
+    else if (errno == EINVAL || errno == EXDEV || errno == ENOSYS ||
+             errno == EOPNOTSUPP || errno == EBADF)
+    {
+      if (verbose)
+        ms_log (1, "Zero-copy output not available (%s), copying records\n",
+                strerror (errno));
+
+      outputcopy = OUTCOPY_NONE;
+    }
+    else if (errno != EINTR)
+    {
+      ms_log (2, "Cannot copy record to '%s': %s\n",
+              ofp->filename, strerror (errno));
+      return -1;
+    }
+  }
+
+  /* Copy any remainder through the record buffer, the output buffer
+   * is empty so the file descriptor is written directly */
+  while (remaining > 0)
+  {
+    copied = pread (infd, recordbuf,
+                    (remaining < sizeof (recordbuf)) ? remaining : sizeof (recordbuf),
+                    inoffset);
+
+    if (copied <= 0)
+    {
+      ms_log (2, "Cannot read %llu bytes at offset %llu from '%s'\n",
+              (long long unsigned)length, (long long unsigned)offset, flp->infilename);
+      return -1;
+    }
+
+    if (write (outfd, recordbuf, copied) != copied)
+    {
+      ms_log (2, "Cannot write to '%s'\n", ofp->filename);
+      return -1;
+    }
+
+    ofp->writes++;
+    ofp->written += copied;
+    inoffset += copied;
+    remaining -= copied;
+  }
+
+  countread (flp, offset, length);
+
+  return 0;
+} /* End of copyrange() */
+
+/***************************************************************************
+ * copyflush():
+ *
+ * Copy the pending range of contiguous records to the output files.
+ * Ranges smaller than the record buffer are read and buffered for
+ * output, avoiding a system call per record when consecutive output
+ * records are scattered in the input.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+static int
+copyflush (OutputFile *ofp)
+{
+  OutputFile *of;
+  size_t length = copylength;
+
+  if (length == 0)
+    return 0;
+
+  copylength = 0;
+
+  if (length >= sizeof (recordbuf))
+  {
+    for (of = ofp; of; of = of->next)
+      if (copyrange (copyflp, copyoffset, length, of))
+        return -1;
+
+    return 0;
+  }
+
+  /* Open file for reading if not already done */
+  if (!copyflp->infp)
+    if (!(copyflp->infp = fopen (copyflp->infilename, "rb")))
+    {
+      ms_log (2, "Cannot open '%s' for reading: %s\n",
+              copyflp->infilename, strerror (errno));
+      return -1;
+    }
+
+  if (lmp_fseeko (copyflp->infp, copyoffset, SEEK_SET) == -1)
+  {
+    ms_log (2, "Cannot seek in '%s': %s\n",
+            copyflp->infilename, strerror (errno));
+    return -1;
+  }
+
+  if (fread (recordbuf, length, 1, copyflp->infp) != 1)
+  {
+    ms_log (2, "Cannot read %llu bytes at offset %llu from '%s'\n",
+            (long long unsigned)length, (long long unsigned)copyoffset,
+            copyflp->infilename);
+    return -1;
+  }
+
+  for (of = ofp; of; of = of->next)
+    if (outputwrite (of, recordbuf, length, 0))
+      return -1;
+
+  countread (copyflp, copyoffset, length);
+
+  return 0;
+} /* End of copyflush() */
+
+/***************************************************************************
+ * writerecord():
+ *
+ * Write a single record to the output files and/or DataLink servers,
+ * delaying as needed to simulate a real time stream.  If recptr is
+ * NULL the record is taken from the memory mapped input file, read
+ * from the input file or copied directly to the output file.  With
+ * latency models the record is held until its release time.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+static int
+writerecord (Record *rec, char *recptr, OutputFile *ofp)
+{
+  Filelink *flp;
+  int reclength;
+
+  flp       = REC_FILE (rec);
+  reclength = REC_RECLEN (rec);
+
+  /* Use record directly from memory mapped file */
+  if (!recptr && flp->map)
+  {
+    if ((size_t)REC_OFFSET (rec) + reclength > flp->mapsize)
+    {
+      ms_log (2, "Record at offset %llu extends beyond end of '%s'\n",
+              (long long unsigned)REC_OFFSET (rec), flp->infilename);
+      return -1;
+    }
+
+    recptr = flp->map + REC_OFFSET (rec);
+  }
+  /* Otherwise read record into buffer unless copied directly to output */
+  else if (!recptr && outputcopy == OUTCOPY_NONE)
+  {
+    /* Make sure the record buffer is large enough */
+    if ((size_t)reclength > sizeof (recordbuf))
+    {
+      ms_log (2, "Record length (%d bytes) larger than buffer (%llu bytes)\n",
+              reclength, (long long unsigned int)sizeof (recordbuf));
+      return -1;
+    }
+
+    /* Open file for reading if not already done */
+    if (!flp->infp)
+      if (!(flp->infp = fopen (flp->infilename, "rb")))
+      {
+        ms_log (2, "Cannot open '%s' for reading: %s\n",
+                flp->infilename, strerror (errno));
+        return -1;
+      }
+
+    /* Seek to record offset */
+    if (lmp_fseeko (flp->infp, REC_OFFSET (rec), SEEK_SET) == -1)
+    {
+      ms_log (2, "Cannot seek in '%s': %s\n",
+              flp->infilename, strerror (errno));
+      return -1;
+    }
+
+    /* Read record into buffer */
+    if (fread (recordbuf, reclength, 1, flp->infp) != 1)
+    {
+      ms_log (2, "Cannot read %d bytes at offset %llu from '%s'\n",
+              reclength, (long long unsigned)REC_OFFSET (rec),
+              flp->infilename);
+      return -1;
+    }
+
+    countread (flp, REC_OFFSET (rec), reclength);
+    recptr = recordbuf;
+  }
+
+  /* Hold records for release according to latency models */
+  if (latencymodels)
+    return delayrecord (rec, recptr, ofp);
+
+  return outputrecord (rec, recptr, ofp, rec->endtime);
+} /* End of writerecord() */
+
+/***************************************************************************
+ * outputrecord():
+ *
+ * Output a single record to the output files and/or DataLink servers
+ * at its release time, the data time at which it is delivered.  If
+ * recptr is NULL the record is copied directly to the output file.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+static int
+outputrecord (Record *rec, char *recptr, OutputFile *ofp, hptime_t release)
+{
+  Record retimed;
+  Filelink *flp;
+  OutputFile *of;
+  DLSender *sp;
+  int reclength;
+  int shard;
+  int idx;
+
+  flp       = REC_FILE (rec);
+  reclength = REC_RECLEN (rec);
+
+  /* Track the time span of the records for looping */
+  if (loop)
+  {
+    if (loopstart == HPTERROR || rec->starttime < loopstart)
+      loopstart = rec->starttime;
+    if (loopend == HPTERROR || rec->endtime > loopend)
+      loopend = rec->endtime;
+  }
+
+  /* With -retime the first record output ends at the current time */
+  if (retime && timeshift == HPTERROR)
+  {
+    timeshift = gethptime () - release;
+    timeshift -= timeshift % (HPTMODULUS / 10000);
+  }
+
+  /* Shift record times, records are rewritten in the record buffer and
+   * the shift is a multiple of the BTime resolution to keep the time
+   * precision. */
+  if (timeshift != HPTERROR && timeshift != 0)
+  {
+    if (recptr != recordbuf)
+    {
+      if ((size_t)reclength > sizeof (recordbuf))
+      {
+        ms_log (2, "Record length (%d bytes) larger than buffer (%llu bytes)\n",
+                reclength, (long long unsigned int)sizeof (recordbuf));
+        return -1;
+      }
+
+      memcpy (recordbuf, recptr, reclength);
+      recptr = recordbuf;
+    }
+
+    if (retimerecord (recptr, reclength, timeshift))
+    {
+      ms_log (2, "Cannot re-time record at offset %llu in '%s'\n",
+              (long long unsigned)REC_OFFSET (rec), flp->infilename);
+      return -1;
+    }
+
+    retimed = *rec;
+    retimed.starttime += timeshift;
+    retimed.endtime += timeshift;
+    rec = &retimed;
+  }
+
+  if (verbose > 1)
+  {
+    char srcname[50];
+    char timestr[50];
+    ms_recsrcname (recptr, srcname, 0);
+    ms_hptime2isotimestr (rec->starttime, timestr, 1);
+    ms_log (1, "Writing %s %s\n", srcname, timestr);
+  }
+
+  if (streamdelay)
+    pacerecord ((timeshift != HPTERROR) ? release + timeshift : release);
+  else if (ratelimit > 0.0)
+    raterecord (reclength);
+
+  /* Copy from input file to output files without reading, records
+   * contiguous in the input are coalesced unless pacing output */
+  if (ofp && !recptr)
+  {
+    if (copylength > 0 &&
+        (flp != copyflp || REC_OFFSET (rec) != copyoffset + (off_t)copylength ||
+         copylength + reclength > COPYMAXLEN))
+      if (copyflush (ofp))
+        return -1;
+
+    if (copylength == 0)
+    {
+      copyflp    = flp;
+      copyoffset = REC_OFFSET (rec);
+    }
+
+    copylength += reclength;
+
+    if ((streamdelay || ratelimit > 0.0) && copyflush (ofp))
+      return -1;
+  }
+  /* Write to output files if specified */
+  else if (ofp)
+  {
+    if (copyflush (ofp))
+      return -1;
+
+    for (of = ofp; of; of = of->next)
+      if (outputwrite (of, recptr, reclength,
+                       (flp->map && recptr >= flp->map && recptr < flp->map + flp->mapsize)))
+        return -1;
+  }
+
+  /* Send to DataLink servers if specified, queued for sender threads
+   * when using multiple connections or destinations */
+  if (senders)
+  {
+    shard = selectshard (recptr);
+
+    for (idx = 0; idx < dlcount; idx++)
+    {
+      sp = &senders[idx * dlconns + shard];
+
+      if (sp->started)
+      {
+        if (queuerecord (sp, recptr, rec))
+          return -1;
+      }
+      else
+      {
+        while (sendrecord (sp, recptr, rec))
+          reconnect (sp);
+      }
+    }
+  }
+
+  totalrecsout++;
+  totalbytesout += reclength;
+
+  return 0;
+} /* End of outputrecord() */
+
+/***************************************************************************
+ * delayrecord():
+ *
+ * Deliver a record according to the latency model of its stream.
+ * Input records arrive in end time order, so held records released
+ * by the end time of this record are output first, in release time
+ * order from the heap.  This record is then output if it is released
+ * immediately, otherwise a copy is held until its release time.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+static int
+delayrecord (Record *rec, char *recptr, OutputFile *ofp)
+{
+  static char delaybuf[sizeof (recordbuf)];
+  DelayQueue *dq = &delayqueue;
+  DelayStream *ss;
+  DelayNode node;
+  hptime_t release;
+  int reclength;
+  int retval;
+
+  reclength = REC_RECLEN (rec);
+
+  if (!(ss = delaystream (recptr)))
+    return -1;
+
+  release = (ss->model) ? delayrelease (ss, rec) : rec->endtime;
+
+  /* Output held records released by the end of this record, moving
+   * this record out of the record buffer used to re-time them */
+  if (dq->count > 0 && dq->nodes[0].release <= rec->endtime && recptr == recordbuf)
+  {
+    memcpy (delaybuf, recptr, reclength);
+    recptr = delaybuf;
+  }
+
+  while (dq->count > 0 && dq->nodes[0].release <= rec->endtime)
+  {
+    delaypop (&node);
+
+    retval = outputrecord (&node.rec, node.record, ofp, node.release);
+    free (node.record);
+
+    if (retval)
+      return -1;
+  }
+
+  if (release <= rec->endtime)
+    return outputrecord (rec, recptr, ofp, release);
+
+  /* Hold a copy of the record until its release time */
+  if (!(node.record = (char *)malloc (reclength)))
+  {
+    ms_log (2, "Cannot allocate memory for delayed record\n");
+    return -1;
+  }
+
+  memcpy (node.record, recptr, reclength);
+  node.rec     = *rec;
+  node.release = release;
+  node.seq     = dq->seq++;
+
+  if (delaypush (&node))
+  {
+    free (node.record);
+    return -1;
+  }
+
+  dq->delayed++;
+  dq->delaysum += (double)(release - rec->endtime) / HPTMODULUS;
+
+  if (release - rec->endtime > dq->delaymax)
+    dq->delaymax = release - rec->endtime;
+
+  if (dq->count > dq->maxcount)
+    dq->maxcount = dq->count;
+
+  return 0;
+} /* End of delayrecord() */
+
+/***************************************************************************
+ * delayflush():
+ *
+ * Output all held records in release time order and reset the
+ * release times of the streams for a following pass.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+static int
+delayflush (OutputFile *ofp)
+{
+  DelayQueue *dq = &delayqueue;
+  DelayNode node;
+  int retval = 0;
+  int idx;
+
+  while (dq->count > 0)
+  {
+    delaypop (&node);
+
+    if (retval == 0 && outputrecord (&node.rec, node.record, ofp, node.release))
+      retval = -1;
+
+    free (node.record);
+  }
+
+  for (idx = 0; idx < dq->streamsize; idx++)
+    dq->streams[idx].lastrelease = HPTERROR;
+
+  if (retval == 0 && copyflush (ofp))
+    retval = -1;
+
+  return retval;
+} /* End of delayflush() */
+
+/***************************************************************************
+ * delaystream():
+ *
+ * Find the delivery state of the stream of a record, adding it to the
+ * stream table with the first matching latency model if new.  The
+ * table is doubled in size when half full.
+ *
+ * Returns a pointer to the stream state on success and NULL on error.
+ ***************************************************************************/
+static DelayStream *
+delaystream (char *recptr)
+{
+  DelayQueue *dq = &delayqueue;
+  DelayStream *streams;
+  DelayStream *ss;
+  LatencyModel *model;
+  char srcname[50];
+  uint32_t hash;
+  const char *cp;
+  int size;
+  int idx;
+
+  /* Grow the table, re-inserting existing streams */
+  if (dq->streamcount * 2 >= dq->streamsize)
+  {
+    size = (dq->streamsize) ? dq->streamsize * 2 : 256;
+
+    if (!(streams = (DelayStream *)calloc (size, sizeof (DelayStream))))
+    {
+      ms_log (2, "Cannot allocate memory for stream table\n");
+      return NULL;
+    }
+
+    for (idx = 0; idx < dq->streamsize; idx++)
+    {
+      if (!dq->streams[idx].srcname[0])
+        continue;
+
+      hash = 2166136261u;
+      for (cp = dq->streams[idx].srcname; *cp; cp++)
+        hash = (hash ^ (uint8_t)*cp) * 16777619u;
+
+      while (streams[hash & (size - 1)].srcname[0])
+        hash++;
+
+      streams[hash & (size - 1)] = dq->streams[idx];
+    }
+
+    free (dq->streams);
+    dq->streams    = streams;
+    dq->streamsize = size;
+  }
+
+  ms_recsrcname (recptr, srcname, 1);
+
+  hash = 2166136261u;
+  for (cp = srcname; *cp; cp++)
+    hash = (hash ^ (uint8_t)*cp) * 16777619u;
+
+  for (;; hash++)
+  {
+    ss = &dq->streams[hash & (dq->streamsize - 1)];
+
+    if (!ss->srcname[0])
+      break;
+
+    if (!strcmp (ss->srcname, srcname))
+      return ss;
+  }
+
+  /* Add new stream with the first matching model */
+  for (model = latencymodels; model; model = model->next)
+    if (regexec (&model->pattern, srcname, 0, 0, 0) == 0)
+      break;
+
+  snprintf (ss->srcname, sizeof (ss->srcname), "%s", srcname);
+  ss->model       = model;
+  ss->lastrelease = HPTERROR;
+  dq->streamcount++;
+
+  if (verbose > 1)
+    ms_log (1, "Stream %s %s\n", srcname, (model) ? "has a latency model" : "is not delayed");
+
+  return ss;
+} /* End of delaystream() */
+
+/***************************************************************************
+ * delayrelease():
+ *
+ * Determine the release time of a record from the latency model of
+ * its stream.  A record ending during an outage is held until the
+ * outage ends, releasing the backlog as a burst.  The constant delay
+ * and jitter are added, the record is never released before it ends
+ * and the records of a stream are released in order as delivered by a
+ * telemetry link.
+ *
+ * Returns the release time.
+ ***************************************************************************/
+static hptime_t
+delayrelease (DelayStream *ss, Record *rec)
+{
+  LatencyModel *model = ss->model;
+  hptime_t release    = rec->endtime;
+  hptime_t into;
+
+  if (model->period > 0)
+  {
+    into = (rec->endtime - model->phase) % model->period;
+
+    if (into < 0)
+      into += model->period;
+
+    if (into < model->outage)
+      release = rec->endtime - into + model->outage;
+  }
+
+  release += model->delay;
+
+  if (model->jitter != JITTER_NONE)
+    release += (hptime_t)(randomjitter (model->jitter) * model->jitterscale);
+
+  if (release < rec->endtime)
+    release = rec->endtime;
+
+  if (ss->lastrelease != HPTERROR && release < ss->lastrelease)
+    release = ss->lastrelease;
+
+  ss->lastrelease = release;
+
+  return release;
+} /* End of delayrelease() */
+
+/***************************************************************************
+ * delaypush():
+ *
+ * Add a node to the heap of held records, ordered by release time and
+ * then arrival sequence.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+static int
+delaypush (DelayNode *node)
+{
+  DelayQueue *dq = &delayqueue;
+  DelayNode *nodes;
+  int child;
+  int parent;
+  int size;
+
+  if (dq->count >= dq->size)
+  {
+    size = (dq->size) ? dq->size * 2 : 1024;
+
+    if (!(nodes = (DelayNode *)realloc (dq->nodes, size * sizeof (DelayNode))))
+    {
+      ms_log (2, "Cannot allocate memory for delayed records\n");
+      return -1;
+    }
+
+    dq->nodes = nodes;
+    dq->size  = size;
+  }
+
+  for (child = dq->count++; child > 0; child = parent)
+  {
+    parent = (child - 1) / 2;
+
+    if (dq->nodes[parent].release < node->release ||
+        (dq->nodes[parent].release == node->release && dq->nodes[parent].seq < node->seq))
+      break;
+
+    dq->nodes[child] = dq->nodes[parent];
+  }
+
+  dq->nodes[child] = *node;
+
+  return 0;
+} /* End of delaypush() */
+
+/***************************************************************************
+ * delaypop():
+ *
+ * Remove the node with the earliest release time from the heap of
+ * held records, the heap must not be empty.
+ ***************************************************************************/
+static void
+delaypop (DelayNode *node)
+{
+  DelayQueue *dq = &delayqueue;
+  DelayNode *last;
+  int parent;
+  int child;
+
+  *node = dq->nodes[0];
+  last  = &dq->nodes[--dq->count];
+
+  for (parent = 0; (child = parent * 2 + 1) < dq->count; parent = child)
+  {
+    if (child + 1 < dq->count &&
+        (dq->nodes[child + 1].release < dq->nodes[child].release ||
+         (dq->nodes[child + 1].release == dq->nodes[child].release &&
+          dq->nodes[child + 1].seq < dq->nodes[child].seq)))
+      child++;
+
+    if (last->release < dq->nodes[child].release ||
+        (last->release == dq->nodes[child].release && last->seq < dq->nodes[child].seq))
+      break;
+
+    dq->nodes[parent] = dq->nodes[child];
+  }
+
+  dq->nodes[parent] = *last;
+} /* End of delaypop() */
+
+/***************************************************************************
+ * randomjitter():
+ *
+ * Generate a jitter value in units of the jitter scale.
+ *
+ * Returns the jitter value.
+ ***************************************************************************/
+static double
+randomjitter (int jitter)
+{
+  switch (jitter)
+  {
+  case JITTER_UNIFORM:
+    return randomuniform ();
+  case JITTER_NORMAL:
+    return sqrt (-2.0 * log (1.0 - randomuniform ())) * cos (2.0 * M_PI * randomuniform ());
+  case JITTER_EXP:
+    return -log (1.0 - randomuniform ());
+  }
+
+  return 0.0;
+} /* End of randomjitter() */
+
+/***************************************************************************
+ * randomuniform():
+ *
+ * Generate a uniformly distributed value from 0 up to 1 with a fixed
+ * seed xorshift64* generator, so runs are repeatable.
+ *
+ * Returns the random value.
+ ***************************************************************************/
+static double
+randomuniform (void)
+{
+  jitterstate ^= jitterstate >> 12;
+  jitterstate ^= jitterstate << 25;
+  jitterstate ^= jitterstate >> 27;
+
+  return ((jitterstate * UINT64_C (2685821657736338717)) >> 11) * (1.0 / 9007199254740992.0);
+} /* End of randomuniform() */
+
+/***************************************************************************
+ * pacerecord:
+ *
+ * Wait until the output time of a record to simulate a real time
+ * stream.  Each record is due at a deadline on the monotonic clock,
+ * the time since the first record plus the difference between record
+ * data times, the end time or release time, divided by the delay
+ * factor, so waiting errors do not accumulate over a long run.  The
+ * lateness of each record relative to its deadline is added to the
+ * pacing statistics.
+ ***************************************************************************/
+static void
+pacerecord (hptime_t datatime)
+{
+  static int64_t basetime  = -1;
+  static hptime_t basedata = 0;
+  int64_t deadline;
+  int64_t lateness;
+  int64_t now;
+
+  now = getmonotime ();
+
+  if (basetime < 0)
+  {
+    basetime = now;
+    basedata = datatime;
+  }
+
+  deadline = basetime + (int64_t)((double)(datatime - basedata) *
+                                  (1000000000.0 / HPTMODULUS) / delayfactor);
+
+  if (deadline > now)
+  {
+    if (verbose > 1)
+      ms_log (1, "Sleeping %.6f seconds to simulate streaming\n",
+              (double)(deadline - now) / 1000000000.0);
+
+    pacesleep (deadline);
+    now = getmonotime ();
+  }
+
+  lateness = (now > deadline) ? now - deadline : 0;
+
+  pacestats.hist[latebucket (lateness)]++;
+  pacestats.count++;
+
+  if (lateness > pacestats.max)
+    pacestats.max = lateness;
+} /* End of pacerecord() */
+
+/***************************************************************************
+ * pacesleep:
+ *
+ * Sleep until an absolute deadline on the monotonic clock.  If a spin
+ * wait is set the sleep ends that long before the deadline and the
+ * remainder is busy-waited, avoiding scheduler wakeup latency.  With a
+ * target rate the achieved rate of intervals completed while waiting
+ * is reported.
+ ***************************************************************************/
+static void
+pacesleep (int64_t deadline)
+{
+  struct timespec ts;
+  int64_t wakeup = deadline - spinwait;
+  int64_t now    = getmonotime ();
+
+  /* Send batched records before waiting, re-connecting on error,
+   * sender threads send their own batches when idle */
+  if (deadline > now && senders && !senders[0].started)
+    while (senders[0].dlconn->batchlen > 0 && dl_flushbatch (senders[0].dlconn) < 0)
+      reconnect (&senders[0]);
+
+  if (wakeup > now)
+  {
+#if defined(TIMER_ABSTIME)
+    ts.tv_sec  = wakeup / 1000000000;
+    ts.tv_nsec = wakeup % 1000000000;
+
+    while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+      ;
+#else
+    ts.tv_sec  = (wakeup - now) / 1000000000;
+    ts.tv_nsec = (wakeup - now) % 1000000000;
+
+    while (nanosleep (&ts, &ts) == -1 && errno == EINTR)
+      ;
+#endif
+  }
+
+  while (spinwait > 0 && getmonotime () < deadline)
+    ;
+
+  /* Report target rate intervals completed while waiting */
+  if (ratelimit > 0.0)
+    ratereport (getmonotime ());
+} /* End of pacesleep() */
+
+/***************************************************************************
+ * raterecord:
+ *
+ * Wait until a record may be output at the target rate.  Tokens, in
+ * records or bytes, are added to a bucket at the target rate, limited
+ * to a short burst, and each record waits for and removes its cost in
+ * tokens.  The wait is divided into short sleeps on the monotonic
+ * clock so a ramping target rate is followed.
+ ***************************************************************************/
+static void
+raterecord (int reclength)
+{
+  RateBucket *rb = &ratebucket;
+  double cost    = (ratebytes) ? reclength : 1.0;
+  double burst;
+  double rate;
+  int64_t deadline;
+  int64_t now;
+
+  now = getmonotime ();
+
+  if (rb->basetime < 0)
+  {
+    rb->basetime   = now;
+    rb->filltime   = now;
+    rb->reporttime = now;
+  }
+
+  for (;;)
+  {
+    rb->tokens += targettokens (now - rb->basetime) - targettokens (rb->filltime - rb->basetime);
+    rb->filltime = now;
+
+    /* Limit bursts, always allowing a full record */
+    rate  = targetrate (now - rb->basetime);
+    burst = rate * RATEBURST;
+    if (burst < cost)
+      burst = cost;
+
+    if (rb->tokens > burst)
+      rb->tokens = burst;
+
+    if (rb->tokens >= cost)
+      break;
+
+    deadline = now + RATEMAXWAIT;
+
+    if (rate > 0.0 && (cost - rb->tokens) / rate * 1000000000.0 < RATEMAXWAIT)
+      deadline = now + (int64_t)((cost - rb->tokens) / rate * 1000000000.0) + 1;
+
+    pacesleep (deadline);
+    now = getmonotime ();
+  }
+
+  /* Report intervals completed before this record */
+  ratereport (now);
+
+  rb->tokens -= cost;
+  rb->records++;
+  rb->bytes += reclength;
+} /* End of raterecord() */
+
+/***************************************************************************
+ * targetrate:
+ *
+ * Determine the target rate a time after the first record, following
+ * the ramp up profile.
+ *
+ * Returns the target rate in records or bytes per second.
+ ***************************************************************************/
+static double
+targetrate (int64_t elapsed)
+{
+  double seconds = (double)elapsed / 1000000000.0;
+
+  if (seconds >= ramptime)
+    return ratelimit;
+
+  if (rampprofile == RAMP_LINEAR)
+    return ratelimit * seconds / ramptime;
+
+  if (rampprofile == RAMP_STEP)
+    return ratelimit * (floor (seconds * rampsteps / ramptime) + 1) / rampsteps;
+
+  return ratelimit;
+} /* End of targetrate() */
+
+/***************************************************************************
+ * targettokens:
+ *
+ * Determine the tokens added at the target rate from the first record
+ * until a time after it, the integral of the ramp up profile.
+ *
+ * Returns the count of tokens, records or bytes.
+ ***************************************************************************/
+static double
+targettokens (int64_t elapsed)
+{
+  double seconds = (double)elapsed / 1000000000.0;
+  double width;
+  double step;
+
+  if (rampprofile == RAMP_LINEAR)
+  {
+    if (seconds < ramptime)
+      return ratelimit * seconds * seconds / (2.0 * ramptime);
+
+    return ratelimit * (ramptime / 2.0 + seconds - ramptime);
+  }
+
+  if (rampprofile == RAMP_STEP)
+  {
+    width = ramptime / rampsteps;
+
+    if (seconds < ramptime)
+    {
+      step = floor (seconds / width);
+      return ratelimit / rampsteps * (width * step * (step + 1) / 2.0 + (step + 1) * (seconds - step * width));
+    }
+
+    return ratelimit * (ramptime * (rampsteps + 1) / (2.0 * rampsteps) + seconds - ramptime);
+  }
+
+  return ratelimit * seconds;
+} /* End of targettokens() */
+
+/***************************************************************************
+ * ratereport:
+ *
+ * Report the achieved rate of each one second interval completed by a
+ * time and its deviation from the target rate.  Intervals without
+ * output, such as during a long wait or an input stall, are reported
+ * with the full deviation.
+ ***************************************************************************/
+static void
+ratereport (int64_t now)
+{
+  RateBucket *rb = &ratebucket;
+  double achieved;
+  double expected;
+  double deviation;
+
+  while (rb->basetime >= 0 && now - rb->reporttime >= 1000000000)
+  {
+    expected = targettokens (rb->reporttime + 1000000000 - rb->basetime) -
+               targettokens (rb->reporttime - rb->basetime);
+    achieved  = (ratebytes) ? (double)rb->bytes : (double)rb->records;
+    deviation = (expected > 0.0) ? (achieved - expected) / expected * 100.0 : 0.0;
+
+    ms_log (1, "Output rate %llu records/s, %llu bytes/s, target %.0f %s/s, deviation %+.2f%%\n",
+            (long long unsigned int)rb->records, (long long unsigned int)rb->bytes,
+            expected, (ratebytes) ? "bytes" : "records", deviation);
+
+    rb->reports++;
+    rb->devsum += fabs (deviation);
+    if (fabs (deviation) > rb->devmax)
+      rb->devmax = fabs (deviation);
+
+    rb->reporttime += 1000000000;
+    rb->records = 0;
+    rb->bytes   = 0;
+  }
+} /* End of ratereport() */
+
+/***************************************************************************
+ * latebucket:
+ *
+ * Determine the lateness histogram bucket for a lateness in
+ * nanoseconds.  Values below LATESUB have a bucket each, larger values
+ * are divided into LATESUB buckets per power of 2, a relative
+ * resolution of 1/LATESUB.
+ *
+ * Returns the bucket index.
+ ***************************************************************************/
+static int
+latebucket (int64_t lateness)
+{
+  int shift = 0;
+  int bucket;
+
+  if (lateness < LATESUB)
+    return (lateness > 0) ? (int)lateness : 0;
+
+  while ((lateness >> shift) >= 2 * LATESUB)
+    shift++;
+
+  bucket = (shift + 1) * LATESUB + (int)((lateness >> shift) - LATESUB);
+
+  return (bucket < LATEBUCKETS) ? bucket : LATEBUCKETS - 1;
+} /* End of latebucket() */
+
+/***************************************************************************
+ * latepercentile:
+ *
+ * Determine the lateness at the specified fraction of paced records
+ * from the lateness histogram, as the upper bound of the bucket
+ * containing that record limited to the maximum lateness.
+ *
+ * Returns lateness in nanoseconds.
+ ***************************************************************************/
+static int64_t
+latepercentile (double fraction)
+{
+  uint64_t target;
+  uint64_t count = 0;
+  int64_t upper;
+  int bucket;
+  int shift;
+
+  /* Rank of the record at the fraction, rounded up */
+  target = (uint64_t)(fraction * pacestats.count);
+
+  if ((double)target < fraction * pacestats.count)
+    target++;
+
+  for (bucket = 0; bucket < LATEBUCKETS; bucket++)
+  {
+    count += pacestats.hist[bucket];
+
+    if (count >= target && count > 0)
+      break;
+  }
+
+  if (bucket < LATESUB)
+    upper = bucket;
+  else
+  {
+    shift = bucket / LATESUB - 1;
+    upper = ((int64_t)(LATESUB + bucket % LATESUB + 1) << shift) - 1;
+  }
+
+  return (upper < pacestats.max) ? upper : pacestats.max;
+} /* End of latepercentile() */
+
+/***************************************************************************
+ * startsenders:
+ *
+ * Connect to the DataLink servers.  With multiple connections or
+ * destinations, including output files, a sender thread is started for
+ * each connection to send records from its queue so that a slow
+ * destination does not delay the others.
+ *
+ * Returns 0 on success, and -1 on failure
+ ***************************************************************************/
+static int
+startsenders (void)
+{
+  DLSender *sp;
+  int idx;
+
+  for (idx = 0; idx < sendercount; idx++)
+  {
+    sp = &senders[idx];
+
+    if (dl_connect (sp->dlconn) < 0)
+    {
+      ms_log (2, "Error connecting to DataLink server %s\n", sp->dlconn->addr);
+      return -1;
+    }
+
+    sp->starttime = gethptime ();
+    sp->endtime   = sp->starttime;
+  }
+
+  if (sendercount + outputcount <= 1)
+    return 0;
+
+  for (idx = 0; idx < sendercount; idx++)
+  {
+    sp = &senders[idx];
+
+    if (!(sp->queue = (AckSlot *)calloc (queuelen, sizeof (AckSlot))))
+    {
+      ms_log (2, "Cannot allocate memory for DataLink send queue\n");
+      return -1;
+    }
+
+    pthread_mutex_init (&sp->lock, NULL);
+    pthread_cond_init (&sp->queued, NULL);
+    pthread_cond_init (&sp->sent, NULL);
+
+    if (pthread_create (&sp->thread, NULL, senderworker, sp))
+    {
+      ms_log (2, "Cannot create DataLink sender thread: %s\n", strerror (errno));
+      return -1;
+    }
+
+    sp->started = 1;
+  }
+
+  if (verbose > 1)
+    ms_log (1, "Started %d DataLink sender threads\n", sendercount);
+
+  return 0;
+} /* End of startsenders() */
+
+/***************************************************************************
+ * stopsenders:
+ *
+ * Wait for sender threads to send all queued records, wait for
+ * acknowledgement of all records in flight and disconnect from the
+ * DataLink servers.
+ ***************************************************************************/
+static void
+stopsenders (void)
+{
+  DLSender *sp;
+  int slot;
+  int idx;
+
+  for (idx = 0; idx < sendercount; idx++)
+  {
+    sp = &senders[idx];
+
+    if (sp->started)
+    {
+      pthread_mutex_lock (&sp->lock);
+      sp->done = 1;
+      pthread_cond_signal (&sp->queued);
+      pthread_mutex_unlock (&sp->lock);
+    }
+  }
+
+  for (idx = 0; idx < sendercount; idx++)
+  {
+    sp = &senders[idx];
+
+    if (sp->started)
+    {
+      pthread_join (sp->thread, NULL);
+      sp->started = 0;
+
+      pthread_cond_destroy (&sp->sent);
+      pthread_cond_destroy (&sp->queued);
+      pthread_mutex_destroy (&sp->lock);
+    }
+    else if (ackwindow > 0)
+    {
+      ackwait (sp);
+    }
+
+    if (sp->queue)
+    {
+      for (slot = 0; slot < queuelen; slot++)
+        free (sp->queue[slot].buffer);
+
+      free (sp->queue);
+      sp->queue = NULL;
+    }
+
+    if (sp->dlconn->link != -1)
+      dl_disconnect (sp->dlconn);
+  }
+} /* End of stopsenders() */
+
+/***************************************************************************
+ * selectshard:
+ *
+ * Select the DataLink connection of each destination for a record by
+ * a hash (FNV-1a) of the source name, all records of a stream are sent
+ * in order over the same connection.
+ *
+ * Returns the index of the connection within a destination.
+ ***************************************************************************/
+static int
+selectshard (char *recbuf)
+{
+  char srcname[50];
+  uint32_t hash = 2166136261u;
+  const char *cp;
+
+  if (dlconns <= 1)
+    return 0;
+
+  ms_recsrcname (recbuf, srcname, 0);
+
+  for (cp = srcname; *cp; cp++)
+    hash = (hash ^ (uint8_t)*cp) * 16777619u;
+
+  return hash % dlconns;
+} /* End of selectshard() */
+
+/***************************************************************************
+ * queuerecord:
+ *
+ * Add a copy of a record to the queue of a sender thread.  If the
+ * queue is full the queue policy determines if the record is queued
+ * after waiting for space, dropped, or if the connection is closed and
+ * its records dropped.
+ *
+ * Returns 0 on success, and -1 on failure
+ ***************************************************************************/
+static int
+queuerecord (DLSender *sp, char *recbuf, Record *rec)
+{
+  AckSlot *slot;
+
+  pthread_mutex_lock (&sp->lock);
+
+  while (sp->qcount >= queuelen && !sp->closed)
+  {
+    if (queuepolicy == QUEUE_BLOCK)
+    {
+      pthread_cond_wait (&sp->sent, &sp->lock);
+    }
+    else if (queuepolicy == QUEUE_DISCONNECT)
+    {
+      ms_log (1, "Send queue full for %s, closing connection\n", sp->dlconn->addr);
+
+      sp->closed = 1;
+      pthread_cond_signal (&sp->queued);
+    }
+    else
+    {
+      break;
+    }
+  }
+
+  if (sp->qcount >= queuelen || sp->closed)
+  {
+    sp->dropped++;
+    pthread_mutex_unlock (&sp->lock);
+    return 0;
+  }
+
+  /* The slot is not used by the sender thread until queued, it is
+   * filled without holding the lock */
+  slot = &sp->queue[(sp->qhead + sp->qcount) % queuelen];
+
+  pthread_mutex_unlock (&sp->lock);
+
+  if (slotcopy (slot, recbuf, rec))
+    return -1;
+
+  pthread_mutex_lock (&sp->lock);
+
+  if (sp->closed)
+  {
+    sp->dropped++;
+  }
+  else
+  {
+    sp->qcount++;
+    pthread_cond_signal (&sp->queued);
+  }
+
+  pthread_mutex_unlock (&sp->lock);
+
+  return 0;
+} /* End of queuerecord() */
+
+/***************************************************************************
+ * senderworker:
+ *
+ * Thread routine sending queued records over a DataLink connection,
+ * re-connecting on error.  Batched records are held while waiting for
+ * more records for up to the batch wait time and then sent.  When no
+ * more records will be queued all records in flight are waited for.
+ * If the connection is closed queued and unacknowledged records are
+ * dropped.
+ ***************************************************************************/
+static void *
+senderworker (void *arg)
+{
+  DLSender *sp = (DLSender *)arg;
+  AckSlot *slot;
+  struct timespec deadline;
+  flag closed;
+
+  pthread_mutex_lock (&sp->lock);
+
+  for (;;)
+  {
+    if (sp->closed)
+    {
+      sp->dropped += sp->qcount;
+      sp->qcount = 0;
+      break;
+    }
+
+    if (sp->qcount == 0)
+    {
+      if (sp->done)
+        break;
+
+      if (sp->dlconn->batchlen <= 0)
+      {
+        pthread_cond_wait (&sp->queued, &sp->lock);
+        continue;
+      }
+
+      /* Hold batched records for up to the batch wait, then send */
+      clock_gettime (CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += dlbatchwait / 1000;
+      deadline.tv_nsec += (long)(dlbatchwait % 1000) * 1000000;
+
+      if (deadline.tv_nsec >= 1000000000)
+      {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+      }
+
+      if (pthread_cond_timedwait (&sp->queued, &sp->lock, &deadline) != ETIMEDOUT)
+        continue;
+
+      pthread_mutex_unlock (&sp->lock);
+
+      while (sp->dlconn->batchlen > 0 && dl_flushbatch (sp->dlconn) < 0)
+        reconnect (sp);
+
+      pthread_mutex_lock (&sp->lock);
+      continue;
+    }
+
+    slot = &sp->queue[sp->qhead];
+
+    pthread_mutex_unlock (&sp->lock);
+
+    while (sendrecord (sp, slot->buffer, &slot->rec) && !senderclosed (sp))
+      reconnect (sp);
+
+    pthread_mutex_lock (&sp->lock);
+
+    sp->qhead = (sp->qhead + 1) % queuelen;
+    sp->qcount--;
+    pthread_cond_signal (&sp->sent);
+  }
+
+  /* Drop unacknowledged records of a closed connection */
+  closed = sp->closed;
+  if (closed)
+  {
+    sp->dropped += sp->ackwin.count;
+    sp->ackwin.count = 0;
+  }
+
+  pthread_mutex_unlock (&sp->lock);
+
+  if (closed && sp->dlconn->link != -1)
+    dl_disconnect (sp->dlconn);
+
+  if (ackwindow > 0)
+    ackwait (sp);
+
+  return NULL;
+} /* End of senderworker() */
+
+/***************************************************************************
+ * senderclosed:
+ *
+ * Check if a connection has been closed by the queue policy.
+ *
+ * Returns 1 if closed and 0 otherwise.
+ ***************************************************************************/
+static int
+senderclosed (DLSender *sp)
+{
+  int closed;
+
+  if (!sp->started)
+    return 0;
+
+  pthread_mutex_lock (&sp->lock);
+  closed = sp->closed;
+  pthread_mutex_unlock (&sp->lock);
+
+  return closed;
+} /* End of senderclosed() */
+
+/***************************************************************************
+ * slotcopy:
+ *
+ * Copy a record and its entry into an AckSlot, growing the slot buffer
+ * as needed.
+ *
+ * Returns 0 on success, and -1 on failure
+ ***************************************************************************/
+static int
+slotcopy (AckSlot *slot, char *recbuf, Record *rec)
+{
+  int reclength = REC_RECLEN (rec);
+
+  if (slot->bufsize < reclength)
+  {
+    free (slot->buffer);
+    slot->bufsize = 0;
+
+    if (!(slot->buffer = (char *)malloc (reclength)))
+    {
+      ms_log (2, "Cannot allocate memory for record copy\n");
+      return -1;
+    }
+
+    slot->bufsize = reclength;
+  }
+
+  memcpy (slot->buffer, recbuf, reclength);
+  slot->rec = *rec;
+
+  return 0;
+} /* End of slotcopy() */
+
+/***************************************************************************
+ * sendrecord:
+ *
+ * Send the specified record to the DataLink server over the specified
+ * connection.
+ *
+ * With an acknowledgement window the record is kept until the server
+ * acknowledges it, first waiting for the oldest acknowledgement if the
+ * window is full.  Acknowledgements that have already arrived are
+ * collected after sending.
+ *
+ * Returns 0 on success, and -1 on failure
+ ***************************************************************************/
+static int
+sendrecord (DLSender *sp, char *recbuf, Record *rec)
+{
+  AckWindow *ackwin = &sp->ackwin;
+  int rv;
+
+  if (!recbuf || !rec)
+    return -1;
+
+  if (ackwindow <= 0)
+  {
+    if (sendpacket (sp, recbuf, rec, 0))
+      return -1;
+  }
+  else
+  {
+    if (!ackwin->slots &&
+        !(ackwin->slots = (AckSlot *)calloc (ackwindow, sizeof (AckSlot))))
+    {
+      ms_log (2, "Cannot allocate memory for acknowledgement window\n");
+      return -1;
+    }
+
+    /* Wait for the oldest acknowledgement if the window is full */
+    while (ackwin->count >= ackwindow)
+      if (ackreceive (sp, 1) < 0)
+        return -1;
+
+    if (sendpacket (sp, recbuf, rec, 1))
+      return -1;
+
+    /* Keep a copy of the record until acknowledged */
+    if (slotcopy (&ackwin->slots[(ackwin->head + ackwin->count) % ackwindow], recbuf, rec))
+      return -1;
+
+    ackwin->count++;
+
+    /* Collect acknowledgements already received, on error the record
+     * is in the window and is resent after re-connecting */
+    while (ackwin->count > 0 && (rv = ackreceive (sp, 0)) != 0)
+    {
+      if (rv < 0)
+        reconnect (sp);
+    }
+  }
+
+  sp->records++;
+  sp->bytes += REC_RECLEN (rec);
+  sp->endtime = gethptime ();
+
+  return 0;
+} /* End of sendrecord() */
+
+/***************************************************************************
+ * sendpacket:
+ *
+ * Send a WRITE command with the specified record to the DataLink
+ * server, requesting an acknowledgement if ack is true.  The reply is
+ * not waited for, acknowledgements are received with ackreceive().
+ *
+ * Returns 0 on success, and -1 on failure
+ ***************************************************************************/
+static int
+sendpacket (DLSender *sp, char *recbuf, Record *rec, flag ack)
+{
+  DLCP *dlconn = sp->dlconn;
+  char streamid[100];
+  char header[255];
+  int headerlen;
+  int reclength = REC_RECLEN (rec);
+
+  /* Generate stream ID for this record: NET_STA_LOC_CHAN/MSEED */
+  ms_recsrcname (recbuf, streamid, 0);
+  strcat (streamid, "/MSEED");
+
+  /* Send record to server without acknowledgement */
+  if (!ack)
+  {
+    if (dl_write (dlconn, recbuf, reclength, streamid,
+                  rec->starttime, rec->endtime, 0) < 0)
+      return -1;
+
+    return 0;
+  }
+
+  if (dlconn->link < 0)
+    return -1;
+
+  if (dlconn->maxpktsize > 0 && reclength > dlconn->maxpktsize)
+  {
+    ms_log (2, "Record length (%d) greater than DataLink max packet size (%d)\n",
+            reclength, dlconn->maxpktsize);
+    return -1;
+  }
+
+  /* Create packet header with command: "WRITE streamid hpdatastart hpdataend flags size" */
+  headerlen = snprintf (header, sizeof (header), "WRITE %s %lld %lld A %d",
+                        streamid, (long long int)rec->starttime,
+                        (long long int)rec->endtime, reclength);
+
+  if (dl_sendpacket (dlconn, header, headerlen, recbuf, reclength, NULL, 0) < 0)
+  {
+    ms_log (2, "Error sending WRITE command to DataLink server\n");
+    return -1;
+  }
+
+  return 0;
+} /* End of sendpacket() */
+
+/***************************************************************************
+ * ackreceive:
+ *
+ * Receive a reply from the DataLink server and match it to the oldest
+ * record in the acknowledgement window.  Records rejected by the
+ * server are reported and not retransmitted.  If block is false only
+ * a reply that is already available is received.
+ *
+ * Returns 1 if a reply was received, 0 if no reply was available and
+ * -1 on error.
+ ***************************************************************************/
+static int
+ackreceive (DLSender *sp, flag block)
+{
+  DLCP *dlconn      = sp->dlconn;
+  AckWindow *ackwin = &sp->ackwin;
+  char reply[256];
+  char srcname[50];
+  char timestr[30];
+  int64_t pktid = 0;
+  AckSlot *slot;
+  int rv;
+
+  if (dlconn->link < 0)
+    return -1;
+
+  /* Reply buffer must hold the maximum header size, 255 */
+  if ((rv = dl_recvheader (dlconn, reply, sizeof (reply) - 1, block)) == 0 && !block)
+    return 0;
+
+  if (rv <= 0)
+  {
+    ms_log (2, "Error receiving acknowledgement from DataLink server\n");
+    return -1;
+  }
+
+  if (ackwin->count <= 0)
+  {
+    ms_log (2, "Unexpected reply from DataLink server: %s\n", reply);
+    return -1;
+  }
+
+  /* Parse reply, the buffer is terminated at the given length */
+  if ((rv = dl_handlereply (dlconn, reply, sizeof (reply) - 1, &pktid)) < 0)
+    return -1;
+
+  slot = &ackwin->slots[ackwin->head];
+
+  if (rv == 1)
+  {
+    ms_recsrcname (slot->buffer, srcname, 0);
+    ms_hptime2seedtimestr (slot->rec.starttime, timestr, 1);
+    ms_log (2, "DataLink server rejected record %s %s: %s\n", srcname, timestr, reply);
+    ackwin->rejected++;
+  }
+  else
+  {
+    if (verbose > 2)
+      ms_log (1, "DataLink server acknowledged packet %lld\n", (long long int)pktid);
+
+    ackwin->acked++;
+  }
+
+  ackwin->head = (ackwin->head + 1) % ackwindow;
+  ackwin->count--;
+
+  return 1;
+} /* End of ackreceive() */
+
+/***************************************************************************
+ * ackresend:
+ *
+ * Retransmit all records in the acknowledgement window, in the order
+ * originally sent, after re-connecting to the DataLink server.
+ *
+ * Returns 0 on success, and -1 on failure
+ ***************************************************************************/
+static int
+ackresend (DLSender *sp)
+{
+  AckWindow *ackwin = &sp->ackwin;
+  AckSlot *slot;
+  int idx;
+
+  for (idx = 0; idx < ackwin->count; idx++)
+  {
+    slot = &ackwin->slots[(ackwin->head + idx) % ackwindow];
+
+    if (sendpacket (sp, slot->buffer, &slot->rec, 1))
+      return -1;
+
+    ackwin->resent++;
+  }
+
+  if (ackwin->count > 0 && verbose)
+    ms_log (1, "Retransmitted %d unacknowledged records\n", ackwin->count);
+
+  return 0;
+} /* End of ackresend() */
+
+/***************************************************************************
+ * ackwait:
+ *
+ * Wait for acknowledgement of all records in flight, re-connecting and
+ * retransmitting if the connection fails, and release the window.
+ ***************************************************************************/
+static void
+ackwait (DLSender *sp)
+{
+  AckWindow *ackwin = &sp->ackwin;
+  int idx;
+
+  while (ackwin->count > 0)
+  {
+    if (ackreceive (sp, 1) < 0)
+      reconnect (sp);
+  }
+
+  if (ackwin->slots)
+  {
+    for (idx = 0; idx < ackwindow; idx++)
+      free (ackwin->slots[idx].buffer);
+
+    free (ackwin->slots);
+    ackwin->slots = NULL;
+  }
+} /* End of ackwait() */
+
+/***************************************************************************
+ * reconnect:
+ *
+ * Re-connect to the DataLink server, sleeping between failed attempts,
+ * and retransmit any unacknowledged records.  Returns without
+ * re-connecting if the connection has been closed by the queue policy.
+ ***************************************************************************/
+static void
+reconnect (DLSender *sp)
+{
+  while (!senderclosed (sp))
+  {
+    if (verbose)
+      ms_log (1, "Re-connecting to DataLink server %s\n", sp->dlconn->addr);
+
+    /* Re-connect to DataLink server and sleep if error connecting */
+    if (sp->dlconn->link != -1)
+      dl_disconnect (sp->dlconn);
+
+    if (dl_connect (sp->dlconn) < 0)
+    {
+      ms_log (2, "Error re-connecting to DataLink server, sleeping 10 seconds\n");
+      sleep (10);
+    }
+    else if (ackresend (sp) == 0)
+    {
+      return;
+    }
+  }
+} /* End of reconnect() */
+
+/***************************************************************************
+ * addrecord():
+ *
+ * Add a new, uninitialized Record entry to the end of a RecordMap,
+ * growing the record array as needed.  The array grows by 50%, up to
+ * a maximum of RECMAP_MAXGROWTH entries at a time.
+ *
+ * If the RecordMap has a limit and it has been reached the records
+ * are sorted and spilled to disk as a run, emptying the RecordMap.
+ *
+ * Returns a pointer to the new entry on success and NULL on error.
+ ***************************************************************************/
+static Record *
+addrecord (RecordMap *recmap)
+{
+  Record *records;
+  int64_t growth;
+
+  if (!recmap)
+    return NULL;
+
+  /* Spill sorted records to disk when the limit is reached */
+  if (recmap->limit > 0 && recmap->recordcnt >= recmap->limit)
+  {
+    if (spillrecmap (recmap))
+      return NULL;
+  }
+
+  if (recmap->recordcnt >= recmap->allocated)
+  {
+    growth = recmap->allocated / 2;
+
+    if (growth < RECMAP_INITIAL)
+      growth = RECMAP_INITIAL;
+    else if (growth > RECMAP_MAXGROWTH)
+      growth = RECMAP_MAXGROWTH;
+
+    if (recmap->limit > 0 && recmap->allocated + growth > recmap->limit)
+      growth = recmap->limit - recmap->allocated;
+
+    if (!(records = (Record *)realloc (recmap->records,
+                                       (recmap->allocated + growth) * sizeof (Record))))
+    {
+      ms_log (2, "Cannot allocate memory for Record entry\n");
+      return NULL;
+    }
+
+    recmap->records = records;
+    recmap->allocated += growth;
+  }
+
+  return &recmap->records[recmap->recordcnt++];
+} /* End of addrecord() */
+
+/***************************************************************************
+ * packrecord():
+ *
+ * Pack the file index, offset and record length into the location of
+ * a Record.  The record length must be a power of 2 between
+ * MINRECLEN and 2^22 bytes.
+ *
+ * Returns 0 on success and -1 if the values cannot be represented.
+ ***************************************************************************/
+static int
+packrecord (Record *rec, uint32_t fileidx, off_t offset, int reclen)
+{
+  int exponent;
+
+  if (!rec)
+    return -1;
+
+  if (fileidx >= REC_MAXFILES || offset < 0 || (uint64_t)offset > REC_MAXOFFSET)
+    return -1;
+
+  /* Determine record length exponent, reclen must be a power of 2 */
+  for (exponent = 7; exponent < (7 + (1 << REC_EXPBITS)); exponent++)
+    if ((1 << exponent) == reclen)
+      break;
+
+  if (exponent >= (7 + (1 << REC_EXPBITS)))
+    return -1;
+
+  rec->location = ((uint64_t)fileidx << (REC_OFFSETBITS + REC_EXPBITS)) |
+                  ((uint64_t)(exponent - 7) << REC_OFFSETBITS) |
+                  (uint64_t)offset;
+
+  return 0;
+} /* End of packrecord() */
+
+/***************************************************************************
+ * sortrecmap():
+ *
+ * Sort a RecordMap so that records are in time order (by end time)
+ * using a stable LSD radix sort of the record array.  Records with
+ * equal end times retain their input order.
+ *
+ * The counts for all digits are collected in a single pass over the
+ * records, digits that are the same for all records, e.g. the high
+ * bits of times in a limited time range, are skipped.
+ *
+ * When multiple threads are configured the array is divided into
+ * contiguous chunks, one per thread, and each pass is performed in
+ * parallel: each thread counts the digits of its chunk and then
+ * scatters its chunk to offsets ordered by digit and chunk.  The
+ * result is identical to a single threaded sort.
+ *
+ * Return 0 on success and -1 on error.
+ ***************************************************************************/
+static int
+sortrecmap (RecordMap *recmap)
+{
+  SortTask *tasks;
+  Record *src, *dst, *swap;
+  int64_t *counts;
+  int64_t *count;
+  int64_t offset;
+  int64_t total;
+  int64_t chunk;
+  int ntasks;
+  int task;
+  int digit;
+  int pass;
+  int sorted = 0;
+
+  if (!recmap)
+    return -1;
+
+  if (recmap->recordcnt <= 1) /* Done if empty or single entry */
+    return 0;
+
+  /* One task per thread, each with a minimum number of records */
+  ntasks = threadcount;
+  if (recmap->recordcnt / SORTTASKMIN < ntasks)
+    ntasks = (int)(recmap->recordcnt / SORTTASKMIN);
+  if (ntasks < 1)
+    ntasks = 1;
+
+  tasks  = (SortTask *)calloc (ntasks, sizeof (SortTask));
+  counts = (int64_t *)calloc ((size_t)ntasks * RADIXPASSES * RADIXSIZE, sizeof (int64_t));
+  dst    = (Record *)malloc (recmap->recordcnt * sizeof (Record));
+
+  if (!tasks || !counts || !dst)
+  {
+    ms_log (2, "Cannot allocate memory for sorting %lld records\n",
+            (long long int)recmap->recordcnt);
+    free (tasks);
+    free (counts);
+    free (dst);
+    return -1;
+  }
+
+  src   = recmap->records;
+  chunk = (recmap->recordcnt + ntasks - 1) / ntasks;
+
+  for (task = 0; task < ntasks; task++)
+  {
+    tasks[task].start = task * chunk;
+    tasks[task].end   = (task + 1 == ntasks) ? recmap->recordcnt : (task + 1) * chunk;
+    tasks[task].count = counts + (size_t)task * RADIXPASSES * RADIXSIZE;
+    tasks[task].src   = src;
+    tasks[task].pass  = -1;
+  }
+
+  /* Count digit values for all passes */
+  sortphase (tasks, ntasks, sortcount);
+
+  for (pass = 0; pass < RADIXPASSES; pass++)
+  {
+    /* Skip pass if all records have the same digit */
+    digit = (RADIXKEY (&src[0]) >> (pass * RADIXBITS)) & (RADIXSIZE - 1);
+    for (task = 0, total = 0; task < ntasks; task++)
+      total += tasks[task].count[pass * RADIXSIZE + digit];
+
+    if (total == recmap->recordcnt)
+      continue;
+
+    /* Counts per chunk change after the first pass, count again */
+    if (sorted && ntasks > 1)
+    {
+      for (task = 0; task < ntasks; task++)
+      {
+        tasks[task].src  = src;
+        tasks[task].pass = pass;
+      }
+
+      sortphase (tasks, ntasks, sortcount);
+    }
+
+    /* Convert counts to starting offsets, by digit then chunk */
+    for (digit = 0, offset = 0; digit < RADIXSIZE; digit++)
+    {
+      for (task = 0; task < ntasks; task++)
+      {
+        count  = &tasks[task].count[pass * RADIXSIZE + digit];
+        total  = *count;
+        *count = offset;
+        offset += total;
+      }
+    }
+
+    for (task = 0; task < ntasks; task++)
+    {
+      tasks[task].src  = src;
+      tasks[task].dst  = dst;
+      tasks[task].pass = pass;
+    }
+
+    sortphase (tasks, ntasks, sortscatter);
+
+    swap   = src;
+    src    = dst;
+    dst    = swap;
+    sorted = 1;
+  }
+
+  /* Sorted records are in src, free the other buffer, a new buffer
+   * only holds the current records */
+  if (src != recmap->records)
+    recmap->allocated = recmap->recordcnt;
+
+  recmap->records = src;
+  free (dst);
+  free (counts);
+  free (tasks);
+
+  return 0;
+} /* End of sortrecmap() */
+
+/***************************************************************************
+ * sortphase():
+ *
+ * Run a sort routine for each SortTask, in separate threads if more
+ * than one task.  If a thread cannot be created the task is run in
+ * the calling thread.  Returns when all tasks are complete.
+ ***************************************************************************/
+static void
+sortphase (SortTask *tasks, int ntasks, void *(*routine) (void *))
+{
+  int task;
+
+  for (task = 1; task < ntasks; task++)
+    tasks[task].started = (pthread_create (&tasks[task].thread, NULL, routine, &tasks[task]) == 0);
+
+  routine (&tasks[0]);
+
+  for (task = 1; task < ntasks; task++)
+  {
+    if (tasks[task].started)
+      pthread_join (tasks[task].thread, NULL);
+    else
+      routine (&tasks[task]);
+  }
+} /* End of sortphase() */
+
+/***************************************************************************
+ * sortcount():
+ *
+ * Thread routine to count the digit values of the records in the
+ * chunk of a SortTask, for all passes if the pass is negative.
+ ***************************************************************************/
+static void *
+sortcount (void *arg)
+{
+  SortTask *task = (SortTask *)arg;
+  int64_t *count;
+  int64_t idx;
+  uint64_t key;
+  int pass;
+
+  if (task->pass < 0)
+  {
+    for (idx = task->start; idx < task->end; idx++)
+    {
+      key = RADIXKEY (&task->src[idx]);
+
+      for (pass = 0; pass < RADIXPASSES; pass++)
+        task->count[pass * RADIXSIZE + ((key >> (pass * RADIXBITS)) & (RADIXSIZE - 1))]++;
+    }
+
+    return NULL;
+  }
+
+  count = task->count + task->pass * RADIXSIZE;
+  memset (count, 0, RADIXSIZE * sizeof (int64_t));
+
+  for (idx = task->start; idx < task->end; idx++)
+    count[(RADIXKEY (&task->src[idx]) >> (task->pass * RADIXBITS)) & (RADIXSIZE - 1)]++;
+
+  return NULL;
+} /* End of sortcount() */
+
+/***************************************************************************
+ * sortscatter():
+ *
+ * Thread routine to move the records in the chunk of a SortTask to
+ * the offsets of their digit values for the current pass.
+ ***************************************************************************/
+static void *
+sortscatter (void *arg)
+{
+  SortTask *task = (SortTask *)arg;
+  int64_t *count = task->count + task->pass * RADIXSIZE;
+  int64_t idx;
+  int digit;
+
+  for (idx = task->start; idx < task->end; idx++)
+  {
+    digit = (RADIXKEY (&task->src[idx]) >> (task->pass * RADIXBITS)) & (RADIXSIZE - 1);
+    task->dst[count[digit]++] = task->src[idx];
+  }
+
+  return NULL;
+} /* End of sortscatter() */
+
+/***************************************************************************
+ * spillrecmap():
+ *
+ * Sort the records of a RecordMap and write them to a temporary file
+ * as a sorted run, then empty the RecordMap.  When SPILLFANIN runs of
+ * the same level exist they are merged into a single run of the next
+ * level, limiting the number of runs to merge for output.
+ *
+ * This routine may be called concurrently for different RecordMaps.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+static int
+spillrecmap (RecordMap *recmap)
+{
+  SpillRun *runs;
+  FILE *fp;
+  int level;
+  int count;
+  int idx;
+  int retval = 0;
+
+  if (!recmap || recmap->recordcnt <= 0)
+    return 0;
 
-  for (;;)
+  if (sortrecmap (recmap))
+    return -1;
+
+  if (!(fp = spillfile ()))
+    return -1;
+
+  if (fwrite (recmap->records, sizeof (Record), recmap->recordcnt, fp) != (size_t)recmap->recordcnt)
   {
-    p    = top;
-    top  = NULL;
-    tail = NULL;
+    ms_log (2, "Cannot write %lld records to temporary file: %s\n",
+            (long long int)recmap->recordcnt, strerror (errno));
+    fclose (fp);
+    return -1;
+  }
 
-    nmerges = 0; /* count number of merges we do in this pass */
+  pthread_mutex_lock (&spillset.lock);
 
-    while (p)
+  if (spillset.runcount >= spillset.runalloc)
+  {
+    if (!(runs = (SpillRun *)realloc (spillset.runs, (spillset.runalloc + 64) * sizeof (SpillRun))))
     {
-      nmerges++; /* there exists a merge to be done */
+      ms_log (2, "Cannot allocate memory for spilled runs\n");
+      pthread_mutex_unlock (&spillset.lock);
+      fclose (fp);
+      return -1;
+    }
 
-      /* step `insize' places along from p */
-      q     = p;
-      psize = 0;
-      for (i = 0; i < insize; i++)
-      {
-        psize++;
-        q = q->next;
-        if (!q)
-          break;
-      }
+    spillset.runs = runs;
+    spillset.runalloc += 64;
+  }
 
-      /* if q hasn't fallen off end, we have two lists to merge */
-      qsize = insize;
+  spillset.runs[spillset.runcount].fp        = fp;
+  spillset.runs[spillset.runcount].recordcnt = recmap->recordcnt;
+  spillset.runs[spillset.runcount].level     = 0;
+  spillset.runcount++;
+  spillset.recordcnt += recmap->recordcnt;
+  spillset.spillcnt += recmap->recordcnt;
 
-      /* now we have two lists; merge them */
-      while (psize > 0 || (qsize > 0 && q))
-      {
-        /* decide whether next element of merge comes from p or q */
-        if (psize == 0)
-        { /* p is empty; e must come from q. */
-          e = q;
-          q = q->next;
-          qsize--;
-        }
-        else if (qsize == 0 || !q)
-        { /* q is empty; e must come from p. */
-          e = p;
-          p = p->next;
-          psize--;
-        }
-        else if (recordcmp (p, q) <= 0)
-        { /* First element of p is lower (or same), e must come from p. */
-          e = p;
-          p = p->next;
-          psize--;
-        }
-        else
-        { /* First element of q is lower; e must come from q. */
-          e = q;
-          q = q->next;
-          qsize--;
-        }
+  if (verbose > 1)
+    ms_log (1, "Spilled %lld records to disk, %d runs\n",
+            (long long int)recmap->recordcnt, spillset.runcount);
 
-        /* add the next element to the merged list */
-        if (tail)
-          tail->next = e;
-        else
-          top = e;
+  /* Merge runs of a full level, which may fill the next level */
+  for (level = 0; retval == 0; level++)
+  {
+    for (idx = 0, count = 0; idx < spillset.runcount; idx++)
+      if (spillset.runs[idx].level == level)
+        count++;
 
-        tail = e;
-      }
+    if (count < SPILLFANIN)
+      break;
 
-      /* now p has stepped `insize' places along, and q has too */
-      p = q;
-    }
+    retval = spillmerge (level);
+  }
+
+  pthread_mutex_unlock (&spillset.lock);
+
+  recmap->recordcnt = 0;
+
+  return retval;
+} /* End of spillrecmap() */
+
+/***************************************************************************
+ * spillfile():
+ *
+ * Create a temporary file for a spilled run in tmpdir, or the
+ * directory specified by the TMPDIR environment variable, or /tmp.
+ * The file is unlinked immediately and removed when closed.
+ *
+ * Returns a stream opened for update on success and NULL on error.
+ ***************************************************************************/
+static FILE *
+spillfile (void)
+{
+  char path[1024];
+  const char *dir = tmpdir;
+  FILE *fp;
+  int fd;
+
+  if (!dir && !(dir = getenv ("TMPDIR")))
+    dir = "/tmp";
+
+  snprintf (path, sizeof (path), "%s/%s.XXXXXX", dir, PACKAGE);
+
+  if ((fd = mkstemp (path)) < 0)
+  {
+    ms_log (2, "Cannot create temporary file in %s: %s\n", dir, strerror (errno));
+    return NULL;
+  }
+
+  unlink (path);
+
+  if (!(fp = fdopen (fd, "w+b")))
+  {
+    ms_log (2, "Cannot open temporary file: %s\n", strerror (errno));
+    close (fd);
+    return NULL;
+  }
+
+  setvbuf (fp, NULL, _IOFBF, SPILLBUFSIZE);
 
-    tail->next = NULL;
+  return fp;
+} /* End of spillfile() */
 
-    /* If we have done only one merge, we're finished. */
-    if (nmerges <= 1) /* allow for nmerges==0, the empty list case */
+/***************************************************************************
+ * spillmerge():
+ *
+ * Merge all spilled runs of the specified level into a single run of
+ * the next level.  The caller must hold the spillset lock.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+static int
+spillmerge (int level)
+{
+  RunMerger merger;
+  SpillRun *runs;
+  SpillRun merged;
+  Record rec;
+  int runcount = 0;
+  int idx;
+  int rv;
+
+  if (!(runs = (SpillRun *)malloc (spillset.runcount * sizeof (SpillRun))))
+  {
+    ms_log (2, "Cannot allocate memory for spilled runs\n");
+    return -1;
+  }
+
+  /* Move runs of the level out of the set */
+  for (idx = 0; idx < spillset.runcount;)
+  {
+    if (spillset.runs[idx].level == level)
     {
-      recmap->first = top;
-      recmap->last  = tail;
+      runs[runcount++]   = spillset.runs[idx];
+      spillset.runs[idx] = spillset.runs[--spillset.runcount];
+    }
+    else
+    {
+      idx++;
+    }
+  }
 
-      return 0;
+  merged.recordcnt = 0;
+  merged.level     = level + 1;
+
+  if (!(merged.fp = spillfile ()) || mergeropen (&merger, runs, runcount, NULL))
+  {
+    if (merged.fp)
+      fclose (merged.fp);
+    for (idx = 0; idx < runcount; idx++)
+      fclose (runs[idx].fp);
+    free (runs);
+    return -1;
+  }
+
+  while ((rv = mergernext (&merger, &rec)) == 0)
+  {
+    if (fwrite (&rec, sizeof (Record), 1, merged.fp) != 1)
+    {
+      ms_log (2, "Cannot write to temporary file: %s\n", strerror (errno));
+      rv = -1;
+      break;
     }
 
-    /* Otherwise repeat, merging lists twice the size */
-    insize *= 2;
+    merged.recordcnt++;
   }
-} /* End of sortrecmap() */
+
+  mergerclose (&merger);
+
+  for (idx = 0; idx < runcount; idx++)
+    fclose (runs[idx].fp);
+  free (runs);
+
+  if (rv < 0)
+  {
+    fclose (merged.fp);
+    return -1;
+  }
+
+  if (verbose > 1)
+    ms_log (1, "Merged %d spilled runs into one of %lld records\n",
+            runcount, (long long int)merged.recordcnt);
+
+  spillset.runs[spillset.runcount++] = merged;
+  spillset.spillcnt += merged.recordcnt;
+
+  return 0;
+} /* End of spillmerge() */
 
 /***************************************************************************
- * recordcmp():
+ * mergeropen():
  *
- * Compare the start times of each Record for the purposes of sorting
- * a RecordMap.
+ * Initialize a RunMerger to merge sorted runs and, if not NULL, the
+ * records of a sorted RecordMap.  Records are merged by end time,
+ * input file and offset, the same order as a complete sort.
  *
- * Return 1 if rec1 is "greater" than rec2, otherwise return 0.
+ * Returns 0 on success and -1 on error.
  ***************************************************************************/
 static int
-recordcmp (Record *rec1, Record *rec2)
+mergeropen (RunMerger *merger, SpillRun *runs, int runcount, RecordMap *recmap)
 {
-  if (!rec1 || !rec2)
+  int idx;
+
+  memset (merger, 0, sizeof (RunMerger));
+  merger->runs     = runs;
+  merger->runcount = runcount;
+  merger->recmap   = recmap;
+
+  if (!(merger->heap.nodes = (MergeNode *)malloc ((runcount + 1) * sizeof (MergeNode))))
+  {
+    ms_log (2, "Cannot allocate memory for merging runs\n");
     return -1;
+  }
+
+  /* Read runs from the beginning */
+  for (idx = 0; idx < runcount; idx++)
+  {
+    if (fflush (runs[idx].fp) || lmp_fseeko (runs[idx].fp, 0, SEEK_SET))
+    {
+      ms_log (2, "Cannot rewind temporary file: %s\n", strerror (errno));
+      mergerclose (merger);
+      return -1;
+    }
+  }
 
-  if (rec1->endtime > rec2->endtime)
+  for (idx = 0; idx <= runcount; idx++)
   {
+    if (mergerread (merger, idx))
+    {
+      mergerclose (merger);
+      return -1;
+    }
+  }
+
+  return 0;
+} /* End of mergeropen() */
+
+/***************************************************************************
+ * mergernext():
+ *
+ * Return the next Record from a RunMerger.
+ *
+ * Returns 0 when a record is returned, 1 when all records have been
+ * returned and -1 on error.
+ ***************************************************************************/
+static int
+mergernext (RunMerger *merger, Record *rec)
+{
+  uint32_t source;
+
+  if (heappop (&merger->heap, rec, &source))
     return 1;
+
+  if (mergerread (merger, source))
+    return -1;
+
+  return 0;
+} /* End of mergernext() */
+
+/***************************************************************************
+ * mergerread():
+ *
+ * Read the next Record from the specified source of a RunMerger, runs
+ * are numbered from 0 and the RecordMap follows the runs, and add it
+ * to the heap.  Nothing is added when the source is exhausted.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+static int
+mergerread (RunMerger *merger, uint32_t source)
+{
+  Record rec;
+  FILE *fp;
+
+  if (source == (uint32_t)merger->runcount)
+  {
+    if (merger->recmap && merger->recidx < merger->recmap->recordcnt)
+      heappush (&merger->heap, &merger->recmap->records[merger->recidx++], source);
+
+    return 0;
   }
 
+  fp = merger->runs[source].fp;
+
+  if (fread (&rec, sizeof (Record), 1, fp) != 1)
+  {
+    if (ferror (fp))
+    {
+      ms_log (2, "Cannot read temporary file: %s\n", strerror (errno));
+      return -1;
+    }
+
+    return 0;
+  }
+
+  heappush (&merger->heap, &rec, source);
+
   return 0;
-} /* End of recordcmp() */
+} /* End of mergerread() */
+
+/***************************************************************************
+ * mergerclose():
+ *
+ * Free all memory associated with a RunMerger, the runs are not closed.
+ ***************************************************************************/
+static void
+mergerclose (RunMerger *merger)
+{
+  free (merger->heap.nodes);
+  merger->heap.nodes = NULL;
+  merger->heap.count = 0;
+} /* End of mergerclose() */
 
 /***************************************************************************
  * processparam():
@@ -672,8 +6476,8 @@ processparam (int argcount, char **argvec)
   char *selectfile    = 0;
   char *matchpattern  = 0;
   char *rejectpattern = 0;
-  char *dladdress     = 0;
   char *tptr;
+  int idx;
 
   /* Process all command line arguments */
   for (optind = 1; optind < argcount; optind++)
@@ -692,50 +6496,281 @@ processparam (int argcount, char **argvec)
     {
       verbose += strspn (&argvec[optind][1], "v");
     }
-    else if (strcmp (argvec[optind], "-sum") == 0)
+    else if (strcmp (argvec[optind], "-sum") == 0)
+    {
+      basicsum = 1;
+    }
+    else if (strcmp (argvec[optind], "-fullscan") == 0)
+    {
+      fullscan = 1;
+    }
+    else if (strcmp (argvec[optind], "-mmap") == 0)
+    {
+      usemmap = 1;
+    }
+    else if (strcmp (argvec[optind], "-stream") == 0)
+    {
+      streammode = 1;
+    }
+    else if (strcmp (argvec[optind], "-streamwin") == 0)
+    {
+      streammode   = 1;
+      streamwindow = strtol (getoptval (argcount, argvec, optind++), NULL, 10);
+
+      if (streamwindow < 1)
+      {
+        ms_log (2, "Stream window must be 1 or more\n");
+        exit (1);
+      }
+    }
+    else if (strcmp (argvec[optind], "-maxmem") == 0)
+    {
+      if ((maxmem = (int64_t)parsesize (getoptval (argcount, argvec, optind++))) < 1024 * 1024)
+      {
+        ms_log (2, "Memory limit must be at least 1M\n");
+        exit (1);
+      }
+    }
+    else if (strcmp (argvec[optind], "-tmpdir") == 0)
+    {
+      tmpdir = getoptval (argcount, argvec, optind++);
+    }
+    else if (strcmp (argvec[optind], "-prefetch") == 0)
+    {
+      prefetchslots = strtol (getoptval (argcount, argvec, optind++), NULL, 10);
+
+      if (prefetchslots < 0)
+      {
+        ms_log (2, "Prefetch count must be 0 or more\n");
+        exit (1);
+      }
+    }
+    else if (strcmp (argvec[optind], "-iouring") == 0)
+    {
+      useiouring = 1;
+    }
+    else if (strcmp (argvec[optind], "-batch") == 0)
+    {
+      batchsize = strtol (getoptval (argcount, argvec, optind++), NULL, 10);
+
+      if (batchsize < 0)
+      {
+        ms_log (2, "Batch size must be 0 or more\n");
+        exit (1);
+      }
+    }
+    else if (strcmp (argvec[optind], "-index") == 0)
+    {
+      useindex = 1;
+    }
+    else if (strcmp (argvec[optind], "-indexdir") == 0)
+    {
+      useindex = 1;
+      indexdir = getoptval (argcount, argvec, optind++);
+    }
+    else if (strcmp (argvec[optind], "-threads") == 0)
+    {
+      threadcount = strtol (getoptval (argcount, argvec, optind++), NULL, 10);
+
+      if (threadcount < 1)
+      {
+        ms_log (2, "Thread count must be 1 or more\n");
+        exit (1);
+      }
+    }
+    else if (strcmp (argvec[optind], "-s") == 0)
+    {
+      selectfile = getoptval (argcount, argvec, optind++);
+    }
+    else if (strcmp (argvec[optind], "-ts") == 0)
+    {
+      starttime = ms_seedtimestr2hptime (getoptval (argcount, argvec, optind++));
+      if (starttime == HPTERROR)
+        return -1;
+    }
+    else if (strcmp (argvec[optind], "-te") == 0)
+    {
+      endtime = ms_seedtimestr2hptime (getoptval (argcount, argvec, optind++));
+      if (endtime == HPTERROR)
+        return -1;
+    }
+    else if (strcmp (argvec[optind], "-M") == 0)
+    {
+      matchpattern = strdup (getoptval (argcount, argvec, optind++));
+    }
+    else if (strcmp (argvec[optind], "-R") == 0)
+    {
+      rejectpattern = strdup (getoptval (argcount, argvec, optind++));
+    }
+    else if (strcmp (argvec[optind], "-sd") == 0)
+    {
+      streamdelay = 1;
+    }
+    else if (strcmp (argvec[optind], "-df") == 0)
+    {
+      streamdelay = 1;
+      delayfactor = strtod (getoptval (argcount, argvec, optind++), NULL);
+
+      if (delayfactor <= 0.0)
+      {
+        ms_log (2, "Delay factor must be greater than 0\n");
+        exit (1);
+      }
+    }
+    else if (strcmp (argvec[optind], "-rate") == 0)
+    {
+      ratelimit = parserate (getoptval (argcount, argvec, optind++), &ratebytes);
+
+      if (ratelimit <= 0.0)
+      {
+        ms_log (2, "Target rate must be greater than 0\n");
+        exit (1);
+      }
+    }
+    else if (strcmp (argvec[optind], "-ramp") == 0)
+    {
+      tptr = getoptval (argcount, argvec, optind++);
+
+      if (sscanf (tptr, "linear:%lf", &ramptime) == 1 && ramptime > 0.0)
+        rampprofile = RAMP_LINEAR;
+      else if (sscanf (tptr, "step:%lf:%d", &ramptime, &rampsteps) == 2 &&
+               ramptime > 0.0 && rampsteps > 0)
+        rampprofile = RAMP_STEP;
+      else
+      {
+        ms_log (2, "Invalid ramp profile, expected linear:secs or step:secs:steps: %s\n", tptr);
+        exit (1);
+      }
+    }
+    else if (strcmp (argvec[optind], "-retime") == 0)
+    {
+      retime = 1;
+    }
+    else if (strcmp (argvec[optind], "-loop") == 0)
+    {
+      loop = 1;
+    }
+    else if (strcmp (argvec[optind], "-latency") == 0)
+    {
+      if (readlatencyfile (getoptval (argcount, argvec, optind++)) <= 0)
+      {
+        ms_log (2, "Cannot read latency model file\n");
+        exit (1);
+      }
+    }
+    else if (strcmp (argvec[optind], "-spin") == 0)
+    {
+      spinwait = strtoll (getoptval (argcount, argvec, optind++), NULL, 10) * 1000;
+
+      if (spinwait < 0)
+      {
+        ms_log (2, "Spin wait must be 0 or more microseconds\n");
+        exit (1);
+      }
+    }
+    else if (strcmp (argvec[optind], "-o") == 0)
     {
-      basicsum = 1;
+      if (!(outputfiles = (char **)realloc (outputfiles, (outputcount + 1) * sizeof (char *))))
+      {
+        ms_log (2, "Cannot allocate memory for output files\n");
+        exit (1);
+      }
+
+      outputfiles[outputcount++] = getoptval (argcount, argvec, optind++);
     }
-    else if (strcmp (argvec[optind], "-s") == 0)
+    else if (strcmp (argvec[optind], "-outbuf") == 0)
     {
-      selectfile = getoptval (argcount, argvec, optind++);
+      double size = parsesize (getoptval (argcount, argvec, optind++));
+
+      if (size < 65536 || size > 1073741824)
+      {
+        ms_log (2, "Output buffer size must be between 64K and 1G\n");
+        exit (1);
+      }
+
+      outbufsize = (size_t)size;
     }
-    else if (strcmp (argvec[optind], "-ts") == 0)
+    else if (strcmp (argvec[optind], "-direct") == 0)
     {
-      starttime = ms_seedtimestr2hptime (getoptval (argcount, argvec, optind++));
-      if (starttime == HPTERROR)
-        return -1;
+      outdirect = 1;
     }
-    else if (strcmp (argvec[optind], "-te") == 0)
+    else if (strcmp (argvec[optind], "-dl") == 0)
     {
-      endtime = ms_seedtimestr2hptime (getoptval (argcount, argvec, optind++));
-      if (endtime == HPTERROR)
-        return -1;
+      if (!(dladdresses = (char **)realloc (dladdresses, (dlcount + 1) * sizeof (char *))))
+      {
+        ms_log (2, "Cannot allocate memory for DataLink destinations\n");
+        exit (1);
+      }
+
+      dladdresses[dlcount++] = getoptval (argcount, argvec, optind++);
     }
-    else if (strcmp (argvec[optind], "-M") == 0)
+    else if (strcmp (argvec[optind], "-dlconns") == 0)
     {
-      matchpattern = strdup (getoptval (argcount, argvec, optind++));
+      dlconns = strtol (getoptval (argcount, argvec, optind++), NULL, 10);
+
+      if (dlconns < 1 || dlconns > 256)
+      {
+        ms_log (2, "DataLink connections must be between 1 and 256\n");
+        exit (1);
+      }
     }
-    else if (strcmp (argvec[optind], "-R") == 0)
+    else if (strcmp (argvec[optind], "-qlen") == 0)
     {
-      rejectpattern = strdup (getoptval (argcount, argvec, optind++));
+      queuelen = strtol (getoptval (argcount, argvec, optind++), NULL, 10);
+
+      if (queuelen < 1)
+      {
+        ms_log (2, "Send queue length must be 1 or more\n");
+        exit (1);
+      }
     }
-    else if (strcmp (argvec[optind], "-sd") == 0)
+    else if (strcmp (argvec[optind], "-qfull") == 0)
     {
-      streamdelay = 1;
+      tptr = getoptval (argcount, argvec, optind++);
+
+      if (strcmp (tptr, "block") == 0)
+        queuepolicy = QUEUE_BLOCK;
+      else if (strcmp (tptr, "drop") == 0)
+        queuepolicy = QUEUE_DROP;
+      else if (strcmp (tptr, "disconnect") == 0)
+        queuepolicy = QUEUE_DISCONNECT;
+      else
+      {
+        ms_log (2, "Unrecognized queue policy: %s\n", tptr);
+        exit (1);
+      }
     }
-    else if (strcmp (argvec[optind], "-df") == 0)
+    else if (strcmp (argvec[optind], "-dlbatch") == 0)
     {
-      streamdelay = 1;
-      delayfactor = strtod (getoptval (argcount, argvec, optind++), NULL);
+      double size = parsesize (getoptval (argcount, argvec, optind++));
+
+      if (size < 0 || size > 67108864)
+      {
+        ms_log (2, "DataLink batch size must be between 0 and 64M\n");
+        exit (1);
+      }
+
+      dlbatchsize = (int)size;
     }
-    else if (strcmp (argvec[optind], "-o") == 0)
+    else if (strcmp (argvec[optind], "-dlbatchwait") == 0)
     {
-      outputfile = getoptval (argcount, argvec, optind++);
+      dlbatchwait = strtol (getoptval (argcount, argvec, optind++), NULL, 10);
+
+      if (dlbatchwait < 0)
+      {
+        ms_log (2, "DataLink batch wait must be 0 or more\n");
+        exit (1);
+      }
     }
-    else if (strcmp (argvec[optind], "-dl") == 0)
+    else if (strcmp (argvec[optind], "-ackwin") == 0)
     {
-      dladdress = getoptval (argcount, argvec, optind++);
+      ackwindow = strtol (getoptval (argcount, argvec, optind++), NULL, 10);
+
+      if (ackwindow < 0)
+      {
+        ms_log (2, "Acknowledgement window must be 0 or more\n");
+        exit (1);
+      }
     }
     else if (strncmp (argvec[optind], "-", 1) == 0 &&
              strlen (argvec[optind]) > 1)
@@ -779,7 +6814,7 @@ processparam (int argcount, char **argvec)
   }
 
   /* Make sure output file or server was specified */
-  if (!outputfile && !dladdress)
+  if (!outputcount && !dlcount)
   {
     ms_log (2, "No output file or server was specified\n\n");
     ms_log (1, "%s version %s\n\n", PACKAGE, VERSION);
@@ -787,13 +6822,78 @@ processparam (int argcount, char **argvec)
     exit (0);
   }
 
-  /* Allocate and initialize DataLink connection description */
-  if (dladdress && !(dlconn = dl_newdlcp (dladdress, argvec[0])))
+  /* Looping repeats the sorted record list, streaming has none */
+  if (loop && streammode)
+  {
+    ms_log (2, "Looping (-loop) is not supported when streaming (-stream)\n");
+    exit (1);
+  }
+
+  /* Streaming reads records in order from the input files without
+   * scanning into a sorted record list */
+  if (streammode)
+  {
+    tptr = (fullscan)            ? "-fullscan"
+           : (maxmem > 0)        ? "-maxmem"
+           : (prefetchslots > 0) ? "-prefetch"
+           : (useiouring)        ? "-iouring"
+           : (batchsize > 0)     ? "-batch"
+                                 : NULL;
+
+    if (tptr)
+    {
+      ms_log (2, "%s is not supported when streaming (-stream)\n", tptr);
+      exit (1);
+    }
+  }
+
+  /* Output is paced by data time or by target rate, not both */
+  if (ratelimit > 0.0 && streamdelay)
+  {
+    ms_log (2, "Target rate (-rate) cannot be combined with -sd or -df\n");
+    exit (1);
+  }
+
+  if (rampprofile != RAMP_NONE && ratelimit <= 0.0)
   {
-    ms_log (2, "Cannot allocation DataLink descriptor\n");
+    ms_log (2, "Ramp profile (-ramp) requires a target rate (-rate)\n");
     exit (1);
   }
 
+  /* Record times are shifted from the second pass when looping */
+  if (loop && !retime)
+    timeshift = 0;
+
+  /* Default prefetch depth when using io_uring */
+  if (useiouring && prefetchslots == 0)
+    prefetchslots = 64;
+
+  /* Allocate and initialize DataLink connection descriptions */
+  if (dlcount > 0)
+  {
+    sendercount = dlcount * dlconns;
+
+    if (!(senders = (DLSender *)calloc (sendercount, sizeof (DLSender))))
+    {
+      ms_log (2, "Cannot allocate memory for DataLink connections\n");
+      exit (1);
+    }
+
+    for (idx = 0; idx < sendercount; idx++)
+    {
+      if (!(senders[idx].dlconn = dl_newdlcp (dladdresses[idx / dlconns], argvec[0])))
+      {
+        ms_log (2, "Cannot allocation DataLink descriptor\n");
+        exit (1);
+      }
+
+      /* Write-only client, keep the socket in non-blocking mode */
+      senders[idx].dlconn->batchsize = dlbatchsize;
+      senders[idx].dlconn->batchwait = dlbatchwait;
+      senders[idx].dlconn->pollio    = 1;
+    }
+  }
+
   /* Expand match pattern from a file if prefixed by '@' */
   if (matchpattern)
   {
@@ -912,6 +7012,59 @@ getoptval (int argcount, char **argvec, int argopt)
   return 0;
 } /* End of getoptval() */
 
+/***************************************************************************
+ * parsesize:
+ * Parse a size value with an optional K, M or G suffix for kibibytes,
+ * mebibytes or gibibytes.
+ *
+ * Returns size in bytes.
+ ***************************************************************************/
+static double
+parsesize (const char *str)
+{
+  char *endptr;
+  double size = strtod (str, &endptr);
+
+  if (*endptr == 'k' || *endptr == 'K')
+    size *= 1024;
+  else if (*endptr == 'm' || *endptr == 'M')
+    size *= 1024 * 1024;
+  else if (*endptr == 'g' || *endptr == 'G')
+    size *= 1024 * 1024 * 1024;
+
+  return size;
+} /* End of parsesize() */
+
+/***************************************************************************
+ * parserate:
+ *
+ * Parse a target rate in records per second, or in bytes per second if
+ * followed by a B suffix.  Record rates may include decimal K, M or G
+ * multipliers, byte rates binary multipliers as for sizes.
+ *
+ * Returns the rate.
+ ***************************************************************************/
+static double
+parserate (const char *str, flag *bytes)
+{
+  char *endptr;
+  double rate = strtod (str, &endptr);
+
+  *bytes = (strpbrk (endptr, "bB") != NULL);
+
+  if (*bytes)
+    return parsesize (str);
+
+  if (*endptr == 'k' || *endptr == 'K')
+    rate *= 1000;
+  else if (*endptr == 'm' || *endptr == 'M')
+    rate *= 1000000;
+  else if (*endptr == 'g' || *endptr == 'G')
+    rate *= 1000000000;
+
+  return rate;
+} /* End of parserate() */
+
 /***********************************************************************/ /**
  * gethptime:
  *
@@ -936,6 +7089,24 @@ gethptime (void)
   return hptime;
 } /* End of gethptime() */
 
+/***************************************************************************
+ * getmonotime:
+ *
+ * Determine the current time of the monotonic system clock, which is
+ * not affected by changes to the system time.
+ *
+ * Returns current monotonic time in nanoseconds.
+ ***************************************************************************/
+static int64_t
+getmonotime (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+} /* End of getmonotime() */
+
 /***************************************************************************
  * setofilelimit:
  *
@@ -977,6 +7148,101 @@ setofilelimit (int limit)
   return (int)rlim.rlim_cur;
 } /* End of setofilelimit() */
 
+/***************************************************************************
+ * mapfile:
+ *
+ * Memory map an input file for reading, if not already mapped.  The
+ * mapping is advised for sequential access to speed up scanning.
+ * Empty files are not mapped.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+static int
+mapfile (Filelink *flp)
+{
+  struct stat sbuf;
+  void *map;
+  int fd;
+
+  if (!flp)
+    return -1;
+
+  if (flp->map)
+    return 0;
+
+  if ((fd = open (flp->infilename, O_RDONLY)) < 0)
+  {
+    ms_log (2, "Cannot open file: %s (%s)\n", flp->infilename, strerror (errno));
+    return -1;
+  }
+
+  if (fstat (fd, &sbuf))
+  {
+    ms_log (2, "Cannot stat file: %s (%s)\n", flp->infilename, strerror (errno));
+    close (fd);
+    return -1;
+  }
+
+  if (sbuf.st_size > 0)
+  {
+    if ((map = mmap (NULL, (size_t)sbuf.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+      ms_log (2, "Cannot memory map file: %s (%s)\n", flp->infilename, strerror (errno));
+      close (fd);
+      return -1;
+    }
+
+    madvise (map, (size_t)sbuf.st_size, MADV_SEQUENTIAL);
+
+    flp->map     = (char *)map;
+    flp->mapsize = (size_t)sbuf.st_size;
+  }
+
+  /* The mapping remains valid after the descriptor is closed */
+  close (fd);
+
+  return 0;
+} /* End of mapfile() */
+
+/***************************************************************************
+ * adviseinput:
+ *
+ * Apply the specified madvise() advice to all memory mapped input
+ * files.
+ ***************************************************************************/
+static void
+adviseinput (int advice)
+{
+  uint32_t fileidx;
+
+  for (fileidx = 0; fileidx < filecount; fileidx++)
+  {
+    if (fileindex[fileidx]->map)
+      madvise (fileindex[fileidx]->map, fileindex[fileidx]->mapsize, advice);
+  }
+} /* End of adviseinput() */
+
+/***************************************************************************
+ * unmapfiles:
+ *
+ * Release memory mappings of all input files.
+ ***************************************************************************/
+static void
+unmapfiles (void)
+{
+  uint32_t fileidx;
+
+  for (fileidx = 0; fileidx < filecount; fileidx++)
+  {
+    if (fileindex[fileidx]->map)
+    {
+      munmap (fileindex[fileidx]->map, fileindex[fileidx]->mapsize);
+      fileindex[fileidx]->map     = NULL;
+      fileindex[fileidx]->mapsize = 0;
+    }
+  }
+} /* End of unmapfiles() */
+
 /***************************************************************************
  * addfile:
  *
@@ -1007,6 +7273,29 @@ addfile (char *filename)
     return -1;
   }
 
+  /* Add new file to the end of the file index array */
+  if (filecount >= REC_MAXFILES)
+  {
+    ms_log (2, "addfile(): Too many input files, maximum is %llu\n",
+            (long long unsigned int)REC_MAXFILES);
+    return -1;
+  }
+
+  if ((filecount % 1024) == 0)
+  {
+    Filelink **newindex;
+
+    if (!(newindex = (Filelink **)realloc (fileindex, (filecount + 1024) * sizeof (Filelink *))))
+    {
+      ms_log (2, "addfile(): Cannot allocate memory\n");
+      return -1;
+    }
+
+    fileindex = newindex;
+  }
+
+  fileindex[filecount++] = newlp;
+
   /* Add new file to the end of the list */
   if (filelisttail == 0)
   {
@@ -1174,6 +7463,158 @@ readregexfile (char *regexfile, char **pppattern)
   return regexcnt;
 } /* End of readregexfile() */
 
+/***************************************************************************
+ * readlatencyfile:
+ *
+ * Read latency models from a file and add them to the list of models.
+ * Each line contains a regular expression matched against source
+ * names, a constant delay in seconds and optional jitter and outage
+ * specifications:
+ *
+ *   pattern delay [uniform:W|normal:S|exp:M] [outage:period:duration[:offset]]
+ *
+ * Returns the number of models parsed from the file or -1 on error.
+ ***************************************************************************/
+static int
+readlatencyfile (char *latencyfile)
+{
+  FILE *fp;
+  LatencyModel *model;
+  LatencyModel **tail;
+  char line[1024];
+  char *pattern;
+  char *token;
+  char *value;
+  char *duration;
+  char *offset;
+  int modelcnt = 0;
+  int linecnt  = 0;
+
+  if ((fp = fopen (latencyfile, "rb")) == NULL)
+  {
+    ms_log (2, "Cannot open latency model file %s: %s\n",
+            latencyfile, strerror (errno));
+    return -1;
+  }
+
+  if (verbose)
+    ms_log (1, "Reading latency models from %s\n", latencyfile);
+
+  /* Append to any existing models */
+  for (tail = &latencymodels; *tail; tail = &(*tail)->next)
+    ;
+
+  while ((fgets (line, sizeof (line), fp)) != NULL)
+  {
+    linecnt++;
+
+    /* Skip empty and comment lines */
+    if (!(pattern = strtok (line, " \t\r\n")) || *pattern == '#')
+      continue;
+
+    if (!(model = (LatencyModel *)calloc (1, sizeof (LatencyModel))))
+    {
+      ms_log (2, "Cannot allocate memory for latency model\n");
+      fclose (fp);
+      return -1;
+    }
+
+    if (regcomp (&model->pattern, pattern, REG_EXTENDED) != 0)
+    {
+      ms_log (2, "%s line %d: cannot compile expression: %s\n", latencyfile, linecnt, pattern);
+      free (model);
+      fclose (fp);
+      return -1;
+    }
+
+    *tail = model;
+    tail  = &model->next;
+    modelcnt++;
+
+    if (!(token = strtok (NULL, " \t\r\n")) || parseseconds (token, &model->delay))
+    {
+      ms_log (2, "%s line %d: invalid or missing delay\n", latencyfile, linecnt);
+      fclose (fp);
+      return -1;
+    }
+
+    while ((token = strtok (NULL, " \t\r\n")))
+    {
+      if (!(value = strchr (token, ':')))
+        value = token + strlen (token);
+      else
+        *value++ = '\0';
+
+      if (!strcmp (token, "uniform") || !strcmp (token, "normal") || !strcmp (token, "exp"))
+      {
+        model->jitter = (*token == 'u') ? JITTER_UNIFORM : (*token == 'n') ? JITTER_NORMAL : JITTER_EXP;
+
+        if (parseseconds (value, &model->jitterscale))
+        {
+          ms_log (2, "%s line %d: invalid %s jitter: %s\n", latencyfile, linecnt, token, value);
+          fclose (fp);
+          return -1;
+        }
+      }
+      else if (!strcmp (token, "outage"))
+      {
+        /* Split period:duration[:offset] */
+        offset = NULL;
+        if ((duration = strchr (value, ':')))
+        {
+          *duration++ = '\0';
+
+          if ((offset = strchr (duration, ':')))
+            *offset++ = '\0';
+        }
+
+        if (!duration || parseseconds (value, &model->period) || model->period <= 0 ||
+            parseseconds (duration, &model->outage) || model->outage > model->period ||
+            (offset && parseseconds (offset, &model->phase)))
+        {
+          ms_log (2, "%s line %d: invalid outage, expected outage:period:duration[:offset]\n",
+                  latencyfile, linecnt);
+          fclose (fp);
+          return -1;
+        }
+      }
+      else
+      {
+        ms_log (2, "%s line %d: unrecognized model parameter: %s\n", latencyfile, linecnt, token);
+        fclose (fp);
+        return -1;
+      }
+    }
+  }
+
+  fclose (fp);
+
+  return modelcnt;
+} /* End of readlatencyfile() */
+
+/***************************************************************************
+ * parseseconds:
+ *
+ * Parse a non-negative number of seconds into a high precision time.
+ *
+ * Returns 0 on success and -1 on error.
+ ***************************************************************************/
+static int
+parseseconds (const char *str, hptime_t *value)
+{
+  char *endptr;
+  double seconds;
+
+  seconds = strtod (str, &endptr);
+
+  if (endptr == str || *endptr || !(seconds >= 0.0) || seconds > 1e9)
+    return -1;
+
+  *value = (hptime_t)(seconds * HPTMODULUS + 0.5);
+
+  return 0;
+} /* End of parseseconds() */
+
 /***************************************************************************
  * usage():
  * Print the usage message.
@@ -1189,6 +7630,18 @@ usage (void)
            " -h           Show this usage message\n"
            " -v           Be more verbose, multiple flags can be used\n"
            " -sum         Print a basic summary after reading all input files\n"
+           " -threads N   Number of threads used to scan input files and sort, default 1\n"
+           " -fullscan    Fully parse records with libmseed when scanning input files\n"
+           " -mmap        Memory map input files for scanning and output\n"
+           " -stream      Merge time ordered input files instead of sorting all records\n"
+           " -streamwin N  Records of each file held for merging, default 64\n"
+           " -maxmem size Limit memory for the record index, spill to disk beyond (K/M/G)\n"
+           " -tmpdir dir  Directory for records spilled to disk, default TMPDIR or /tmp\n"
+           " -prefetch N  Read N records ahead of output in separate threads\n"
+           " -iouring     Use io_uring for prefetching if available, default -prefetch 64\n"
+           " -batch N     Read input for N output records at a time, coalescing reads\n"
+           " -index       Use and maintain record index files next to input files\n"
+           " -indexdir dir  Use and maintain record index files in specified directory\n"
            "\n"
            " ## Data selection options ##\n"
            " -ts time     Limit to records that contain or start after time\n"
@@ -1200,10 +7653,26 @@ usage (void)
            "\n"
            " -sd          Delay output of data to simulate real time flow\n"
            " -df factor   Delay factor, to retard or accelerate simulated time, default 1\n"
+           " -spin usec   Busy-wait the last usec microseconds before each paced record\n"
+           " -retime      Shift record start times so the first record ends at the current time\n"
+           " -loop        Repeat output endlessly, advancing record times by the data span\n"
+           " -latency file  Delay delivery of streams with latency models read from file\n"
+           " -rate rate   Output at a target rate of records/s (K/M/G = 10^3/6/9), or bytes/s\n"
+           "                with a B suffix (K/M/G = 2^10/20/30)\n"
+           " -ramp profile  Ramp up to the target rate: linear:secs or step:secs:steps\n"
            "\n"
            " ## Output and input options ##\n"
-           " -o file      Specify an output file\n"
-           " -dl server   Specify a DataLink server destination in host:port format\n"
+           " -o file      Specify an output file, may be repeated\n"
+           " -outbuf size Output file buffer and write size (K/M/G), default 1M\n"
+           " -direct      Write output file with O_DIRECT, bypassing the page cache\n"
+           " -dl server   Specify a DataLink server destination in host:port format, may be repeated\n"
+           " -dlconns N   Send to each DataLink server over N connections, sharded by stream\n"
+           " -qlen N      Records queued for each DataLink connection, default 256,\n"
+           "                output files are written directly and are not queued\n"
+           " -qfull policy  Full send queue policy: block (default), drop or disconnect\n"
+           " -ackwin N    Request acknowledgement with up to N DataLink writes in flight\n"
+           " -dlbatch size Batch DataLink packets up to size bytes per send (K/M)\n"
+           " -dlbatchwait ms Maximum time to hold batched DataLink packets, default 100\n"
            "\n"
            " file#        Files(s) of miniSEED records\n"
            "\n");